@@ -77,10 +77,26 @@ pub fn build(b: *std.Build) void {
 
     const run_exe_unit_tests = b.addRunArtifact(exe_unit_tests);
 
+    // The regex engine's tests: test/regex.c builds the editor without its
+    // main() and checks a table of patterns against expected matches
+    const regex_tests = b.addExecutable(.{
+        .name = "regex_test",
+        .target = target,
+        .optimize = optimize,
+    });
+    regex_tests.linkLibC();
+    regex_tests.addCSourceFiles(.{
+        .files = &[_][]const u8{"test/regex.c"},
+        .flags = &exe_flags,
+    });
+
+    const run_regex_tests = b.addRunArtifact(regex_tests);
+
     // Similar to creating the run step earlier, this exposes a `test` step to
     // the `zig build --help` menu, providing a way for the user to request
     // running the unit tests.
     const test_step = b.step("test", "Run unit tests");
     test_step.dependOn(&run_lib_unit_tests.step);
     test_step.dependOn(&run_exe_unit_tests.step);
+    test_step.dependOn(&run_regex_tests.step);
 }
@@ -8,21 +8,52 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define KILO_X86
+#include <immintrin.h>
+#endif
+
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_ADD_BLOCK (64 * 1024)
+#define KILO_SYNTAX_STEP 4096
+#define KILO_MATCH_STEP 65536
+#define KILO_DFA_STATES 1024
+#define KILO_DFA_TABLE 2048
+#define KILO_SPAN_GAP 8
+#define KILO_INPUT_BUF (64 * 1024)
+#define KILO_VT_PARAMS 16
+#define KILO_WHEEL_ROWS 3
+#define KILO_RESIZE_DELAY 16
+#define KILO_UNDO_MEM (16 * 1024 * 1024)
+#define KILO_WRITE_IOV 1024
+#define KILO_WRITE_CHUNK (8 * 1024 * 1024)
+#define KILO_SAVE_PROGRESS 100
+#define KILO_MSG_TIMEOUT 5000
+
+#define UNDO_NONE ((size_t) -1)
+#define UNDO_MAGIC "KILOUND3"
 
 // bitwise AND Ctrl-key with a given character
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -37,7 +68,41 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START,
+    PASTE_END,
+    MOUSE_EVENT,
+    FOCUS_IN,
+    FOCUS_OUT
+};
+
+// Modifier bits or'ed into keys decoded from escape sequences
+#define KEY_SHIFT (1<<16)
+#define KEY_ALT (1<<17)
+#define KEY_CTRL (1<<18)
+#define KEY_MODS (KEY_SHIFT | KEY_ALT | KEY_CTRL)
+
+// Byte classes of the input decoder
+enum vtClass {
+    VC_ESC = 0,
+    VC_BRACKET,
+    VC_O,
+    VC_PARAM,
+    VC_INTER,
+    VC_FINAL,
+    VC_OTHER,
+    VC_COUNT
+};
+
+// States of the input decoder, then the two outcomes of a transition
+enum vtState {
+    VS_GROUND = 0,
+    VS_ESC,
+    VS_CSI,
+    VS_SS3,
+    VS_COUNT,
+    VS_DISPATCH = VS_COUNT,
+    VS_ABORT
 };
 
 enum editorHighlight {
@@ -54,8 +119,37 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// Screen cell attribute: a highlight class, optionally drawn inverted
+#define ATTR_INVERSE (1<<7)
+
+// Timers the event loop can run
+enum editorTimer {
+    TIMER_STATUSMSG = 0,
+    TIMER_RESIZE,
+    TIMER_SAVE,
+    TIMER_COUNT
+};
+
 /*** data ***/
 
+// Slot in a keyword hash table
+struct keyword {
+    const char* word;       // Keyword without its '|' suffix, NULL if the slot is empty
+    int len;                // Length of word
+    unsigned char hl;       // HL_KEYWORD1 or HL_KEYWORD2
+};
+
+// Lookup data derived from an editorSyntax by editorSyntaxCompile()
+struct syntaxTables {
+    int scs_len;            // Length of the single-line comment start
+    int mcs_len;            // Length of the multiline comment start
+    int mce_len;            // Length of the multiline comment end
+    int kw_minlen;          // Length of the shortest keyword
+    int kw_maxlen;          // Length of the longest keyword
+    unsigned int kw_mask;   // Number of keyword slots - 1 (a power of two - 1)
+    struct keyword kw[];    // Open-addressed keyword hash table
+};
+
 struct editorSyntax {
     char* filetype;
     char** filematch;
@@ -64,19 +158,277 @@ struct editorSyntax {
     char* multiline_comment_start;
     char* multiline_comment_end;
     int flags;
+    struct syntaxTables* tables;    // Built when the syntax is first selected
 };
 
 // Data type for storing a row of text
+// Until it is edited the row does not own its characters: chars is a view
+// into the text storage (the original file buffer or the add buffer) and is
+// not NUL-terminated. A row edited in the middle takes a block of its own,
+// which chars then views and which no other row may view
 typedef struct erow {
-    int idx;
     int size;
     int rsize;
-    char* chars;
+    const char* chars;
+    struct addblock* own;   // Block the row edits in place, or NULL
     char* render;
     unsigned char* hl;
-    int hl_open_comment;
+    int hl_open_comment;    // Lexer state at the end of the row
+    int hl_start;           // Lexer state the row was last lexed from, or -1
 } erow;
 
+// Block of the append-only add buffer. Blocks are never moved or reused
+// while the document is open, so row views into them stay valid
+struct addblock {
+    struct addblock* next;  // Previously filled block
+    size_t cap;             // Capacity of data
+    size_t len;             // Bytes used in data
+    char data[];
+};
+
+// Piece table backing the document: every row is a piece viewing either the
+// original file contents or text appended to the add buffer
+struct textbuf {
+    char* orig;             // Original file contents
+    size_t origlen;         // Length of original file contents
+    int orig_mapped;        // Whether orig is mmapped (otherwise malloced)
+    struct addblock* add;   // Add buffer, most recent block first
+};
+
+// Kinds of undo record; an edit continuing a run of typing or deleting at
+// the place the last record left off is merged into that record
+enum undoKind {
+    UNDO_EDIT = 0,
+    UNDO_TYPE,
+    UNDO_DELETE
+};
+
+// Edit in the undo log: nold bytes of text at row at, column col were
+// replaced by nnew bytes, where the text of the document is its rows, each
+// followed by a '\n'
+// The header is followed by the removed bytes, then the inserted bytes,
+// padded to a multiple of 8
+struct undorec {
+    size_t prev;            // Offset of the record before this one, or UNDO_NONE
+    size_t nold;            // Number of bytes removed
+    size_t nnew;            // Number of bytes inserted
+    int kind;               // enum undoKind
+    int group;              // Records made by one command are undone together
+    int at, col;            // Row and column the edit starts at
+    int cy, cx;             // Cursor before the edit
+    int ncy, ncx;           // Cursor after the edit
+};
+
+// Append-only log of undo records
+// Records before top can be undone; records from top to len can be redone
+// until the next edit truncates them
+// Offsets are into the whole log: buf holds the tail from base on, and the
+// log before base has been spilled to the undo file
+struct undolog {
+    char* buf;
+    size_t base;            // Log offset of buf[0]
+    size_t len;             // End of the log
+    size_t cap;             // Bytes allocated for buf
+    size_t top;             // End of the records that can be undone
+    size_t last;            // Offset of the record ending at top, or UNDO_NONE
+    size_t open;            // Offset of the record being written, or UNDO_NONE
+    int at, col;            // Where the text the edit being recorded inserts starts
+    int eol;                // Whether to end the open record's text with a '\n' again
+    int group;              // Group of the command being run
+    int fd;                 // Undo file, or -1 if not opened yet
+    char* path;             // Path of the undo file, or NULL until known
+    size_t synced;          // Length of the log the undo file header describes
+    char* scratch;          // Spilled record read back from the undo file
+    size_t scratchcap;      // Bytes allocated for scratch
+};
+
+// Header of an undo file, followed by the log
+// The log applies to the document on disk if it is still the file it was
+// saved as (same size, inode and modification time), or failing that if its
+// contents hash to hash
+struct undofile {
+    char magic[8];          // UNDO_MAGIC
+    uint64_t hash;          // editorHash() of the document
+    uint64_t size;          // Size of the document
+    uint64_t ino;           // Inode of the document
+    uint64_t dev;           // Device of the document
+    int64_t mtime;          // Modification time of the document in nanoseconds
+    uint64_t len;           // Length of the log
+    uint64_t top;           // struct undolog fields when the document was saved
+    uint64_t last;
+    int64_t group;
+};
+
+// editorHash() of a text being passed in pieces
+struct hasher {
+    uint64_t h;
+    char word[8];           // Bytes of the word the next piece starts
+    int n;                  // Number of bytes in word
+};
+
+// Append buffer allows update of entire screen at once each refresh
+struct abuf {
+    char *b;    // pointer to buffer
+    int len;    // length of buffer
+    int cap;    // allocated size of buffer
+};
+
+// Ring buffer of input read from the terminal but not yet decoded
+// head and tail only grow; mask them with KILO_INPUT_BUF - 1 to index buf
+struct inbuf {
+    char buf[KILO_INPUT_BUF];
+    unsigned int head;      // Count of bytes ever read into buf
+    unsigned int tail;      // Count of bytes ever taken out of buf
+};
+
+// Operations of the nodes of a compiled regex
+enum reOp {
+    RE_CLASS = 0,
+    RE_SPLIT,
+    RE_JMP,
+    RE_BOL,
+    RE_EOL,
+    RE_MATCH
+};
+
+// Node of a regex compiled to a Thompson NFA
+struct reNode {
+    int op;                 // enum reOp
+    int out, out1;          // Next nodes (out1 only for RE_SPLIT)
+    uint32_t cls[8];        // Bytes an RE_CLASS node consumes, as a bitmap
+};
+
+// Part of a regex being compiled: its entry node, and an RE_JMP exit node
+// whose target is set by whatever follows
+struct reFrag {
+    int start;
+    int end;
+};
+
+// State of a lazily built DFA: a set of NFA nodes
+struct dfaState {
+    int next[256];          // State after each byte, or -1 until first taken
+    int accept;             // Whether the set holds the match node
+    int accepteol;          // Whether the set matches at the end of a row
+    int n;                  // Number of nodes in set
+    int set[];              // Sorted node indexes
+};
+
+// DFA built from a regex one transition at a time, as input needs it
+struct dfa {
+    int anchored;           // Whether matches must begin where a run begins
+    struct dfaState** states;       // States built so far
+    int numstates;          // Number of states
+    int* table;             // States by node set (open addressing), -1 if empty
+    int start[2];           // Start state away from and at the start of a row, or -1
+};
+
+// Compiled regular expression
+struct regex {
+    struct reNode* nodes;   // NFA nodes
+    int numnodes;           // Number of nodes
+    int cap;                // Number of nodes allocated
+    int start;              // Entry node
+    int error;              // Set while compiling a malformed pattern
+    int* set;               // Scratch node set for building states
+    int* stack;             // Scratch stack for closures
+    int* mark;              // Generation of the set each node was last added to
+    int markgen;            // Generation of the set being built
+    int* threads[2];        // Node sets of reSearch() before and after a byte
+    int* starts[2];         // Where the match each thread is part of starts
+    struct dfa fwd;         // Finds where the earliest match ends
+    struct dfa anchored;    // Finds the longest match from a given start
+};
+
+// Span of a row drawn in a highlight class over its syntax highlighting
+struct hlrange {
+    int row;                // Row index
+    int start;              // First chars column of the span
+    int end;                // Chars column just after the span
+    unsigned char hl;       // Highlight class drawn over the span
+};
+
+// Row of the match index and how many matches precede it
+struct matchrow {
+    int row;                // Row index
+    int first;              // Number of matches in earlier rows
+};
+
+// Rows holding matches of the search query, indexed in idle time
+struct matchindex {
+    char* query;            // Query being searched for, NULL when not searching
+    size_t qlen;            // Length of query
+    struct matchrow* rows;  // Rows with at least one match, in order
+    int numrows;            // Number of entries in rows
+    int cap;                // Number of entries allocated
+    int total;              // Number of matches in the rows scanned so far
+    int scanned;            // Rows before this one have been scanned
+    int current;            // Entry of the current match, or -1
+    int col;                // Column of the current match in its row
+    int len;                // Length of the current match
+    int ordinal;            // Number of matches before it in its row
+    int regex;              // Whether queries are regular expressions
+    struct regex* re;       // Compiled query in regex mode
+    int bad;                // Whether the query is a malformed regex
+};
+
+// Escape sequence being decoded from the input
+struct vtseq {
+    char intro;             // '[' for CSI or 'O' for SS3
+    char prefix;            // Private parameter prefix such as '<', or 0
+    int params[KILO_VT_PARAMS];     // Numeric parameters
+    int nparams;            // Number of parameters
+    char final;             // Final byte
+};
+
+// Last mouse report decoded from the input
+struct mouseEvent {
+    int button;             // Button number and flags, as sent by the terminal
+    int x, y;               // Screen column and row, from 0
+    int press;              // 1 for a press or drag, 0 for a release
+};
+
+// Callback the event loop runs at a set time
+struct timer {
+    long long due;          // editorNow() time to run at
+    void (*fn)(void);       // Function to run, NULL if the timer is not set
+};
+
+// Save running on the writer thread
+// The thread writes a snapshot of the rows' text, which stays valid while
+// the rows change since the text storage is never modified or freed until
+// the main thread finishes the save
+struct savejob {
+    int running;            // Whether a save is in progress
+    int finished;           // Whether the writer thread is done, under lock
+    char* filename;         // Name of the file being written
+    char* target;           // File the name resolves to, which is replaced
+    char* tmp;              // Temporary file renamed over target once written,
+                            // or NULL if target is written in place
+    int fd;                 // The file being written
+    struct iovec* iov;      // Snapshot of the document as pieces of text
+    int numiov;             // Number of pieces
+    int cap;                // Number of pieces allocated
+    size_t len;             // Bytes to write
+    int dirty;              // E.dirty when the snapshot was taken
+    long long start;        // editorNow() when the save started
+    pthread_t thread;       // Writer thread
+    pthread_mutex_t lock;   // Guards written
+    size_t written;         // Bytes written so far
+    int err;                // errno of the failure, or 0 once saved
+    char* map;              // Mapping of the saved file, or NULL
+    uint64_t hash;          // editorHash() of the saved file
+    struct stat st;         // Status of the saved file
+};
+
+// Screen contents, one character and attribute per cell
+struct frame {
+    int rows, cols;         // Size of the frame
+    char* chars;            // rows * cols characters
+    unsigned char* attrs;   // Attribute of each character
+    int cy, cx;             // Cursor position
+};
+
 struct editorConfig {
     int cx, cy;             // Absolute cursor x and y position
     int rx;                 // Rendered cursor x position, to account for tabs
@@ -86,15 +438,40 @@ struct editorConfig {
     int screencols;         // Number of columns on screen
 
     int numrows;            // Number of rows in the file
-    erow* row;              // Array of rows of text
+    erow* row;              // Gap buffer of rows of text (use editorRowAt())
+    int rowcap;             // Number of row slots allocated
+    int gap;                // Row index where the gap starts
+    struct textbuf text;    // Storage the rows are views into
+    struct undolog undo;    // Edits that can be undone and redone
+    struct savejob save;    // Save in progress
+    int syntaxrows;         // Number of leading rows with a known lexer state
+    int syntaxdirty;        // Last row that may not follow on from its predecessor
 
     char* filename;         // Name of open file
     int dirty;              // Dirty bit: has file been edited?
 
     char statusmsg[80];     // Status bar message string
-    time_t statusmsg_time;  // Current time
+    long long statusmsg_time;   // editorNow() when the message was set
 
     struct editorSyntax* syntax;    // Syntax highlighting rules
+    struct matchindex matches;      // Matches of the search in progress
+    struct hlrange* overlay;        // Spans drawn over syntax highlighting
+    int numoverlay;                 // Number of spans in overlay
+    int overlaycap;                 // Number of spans allocated
+
+    struct frame frame;     // Frame being drawn
+    struct frame shadow;    // Frame last sent to the terminal
+    int screenvalid;        // Whether the terminal still shows the shadow frame
+    struct abuf ab;         // Output of each refresh, kept between refreshes
+    char attresc[256][12];  // Escape sequence selecting each cell attribute
+    int attresclen[256];    // Length of each escape sequence
+
+    struct inbuf in;        // Input waiting to be decoded into keys
+    struct mouseEvent mouse;        // Last MOUSE_EVENT key's report
+    int mousecapture;       // Whether the terminal reports the mouse to us
+    int prompting;          // Whether editorPrompt() is reading an answer
+    int sigpipe[2];         // Self-pipe signal handlers wake the event loop through
+    struct timer timers[TIMER_COUNT];   // Pending timers, indexed by enum editorTimer
 
     struct termios orig_termios;    // Settings to be restored after exiting raw mode
 };
@@ -119,7 +496,8 @@ struct editorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     },
 };
 
@@ -129,7 +507,10 @@ struct editorSyntax HLDB[] = {
 
 void editorSetStatusMessage(const char* fmt, ...);
 void editorRefreshScreen(void);
-char* editorPrompt(char* prompt, void(*callback)(char*, int));
+void editorWait(void);
+long long editorNow(void);
+void editorSetTimer(int id, int ms, void (*fn)(void));
+char* editorPrompt(char* prompt, void(*callback)(char*, int), int allowempty);
 
 /*** terminal ***/
 
@@ -145,6 +526,8 @@ void die(const char* s) {
 }
 
 void disableRawMode(void) {
+    // Turn bracketed paste, focus and mouse reporting back off
+    write(STDOUT_FILENO, "\x1b[?2004l\x1b[?1004l\x1b[?1006l\x1b[?1002l", 32);
     // Set terminal attributes to original values, or exit the program on failure
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
         die("tcsetattr");
@@ -175,84 +558,250 @@ void enableRawMode(void) {
     // Set minimum number of bytes of input needed before read() returns
     raw.c_cc[VMIN] = 0;
     // Set maximum amount of time before read() returns to 100 ms
+    // editorWait() sleeps until input arrives, so this only bounds the wait
+    // for the rest of an escape sequence
     raw.c_cc[VTIME] = 1;
 
     // Write flags to attributes, or exit the program on failure
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         die("tcsetattr");
     }
+    // Ask the terminal to bracket pasted text with PASTE_START and PASTE_END,
+    // and to send FOCUS_IN and FOCUS_OUT as the window gains and loses focus
+    write(STDOUT_FILENO, "\x1b[?2004h\x1b[?1004h", 16);
 }
 
-// Return keypresses from the terminal
-int editorReadKey(void) {
-    int nread = 0;
-    char c;
-
-    // Run until keypress is detected, then read it to c
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        // Read each character as it is typed, or exit the program on failure
-        // Do not treat timeouts as errors
-        if (nread == -1 && errno != EAGAIN) {
+// Turn mouse capture on or off
+// While on, the terminal reports buttons and drags as SGR sequences instead
+// of selecting text itself
+void editorSetMouseCapture(int on) {
+    E.mousecapture = on;
+    if (on) {
+        write(STDOUT_FILENO, "\x1b[?1002h\x1b[?1006h", 16);
+    } else {
+        write(STDOUT_FILENO, "\x1b[?1006l\x1b[?1002l", 16);
+    }
+}
+
+// Read as much input as is available and fits into the input ring
+// Return the number of bytes read
+int editorFillInput(void) {
+    struct inbuf* in = &E.in;
+    // Restart at the front of the ring when it empties, so one read can fill it
+    if (in->head == in->tail) {
+        in->head = 0;
+        in->tail = 0;
+    }
+    unsigned int off = in->head & (KILO_INPUT_BUF - 1);
+    unsigned int room = KILO_INPUT_BUF - (in->head - in->tail);
+    if (room > KILO_INPUT_BUF - off) {
+        room = KILO_INPUT_BUF - off;
+    }
+    if (room == 0) {
+        return 0;
+    }
+
+    // Exit the program on failure, but do not treat timeouts as errors
+    int nread = read(STDIN_FILENO, &in->buf[off], room);
+    if (nread == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
             die("read");
         }
+        return 0;
+    }
+    in->head += nread;
+    return nread;
+}
+
+// Return whether input is queued that has not been decoded yet
+int editorInputPending(void) {
+    return E.in.head != E.in.tail;
+}
+
+// Take the next byte of input, waiting no longer than the VTIME timeout
+// Return 1 on success, or 0 if no byte arrived in time
+int editorReadByte(char* c) {
+    if (!editorInputPending() && editorFillInput() == 0) {
+        return 0;
     }
+    *c = E.in.buf[E.in.tail++ & (KILO_INPUT_BUF - 1)];
+    return 1;
+}
 
-    // Handle escape characters by reading the next two bytes into buffer seq
+// Classify a byte for the input decoder
+int vtClassOf(unsigned char c) {
     if (c == '\x1b') {
-        char seq[3];
+        return VC_ESC;
+    }
+    if (c == '[') {
+        return VC_BRACKET;
+    }
+    if (c == 'O') {
+        return VC_O;
+    }
+    if (c >= 0x30 && c <= 0x3f) {
+        return VC_PARAM;
+    }
+    if (c >= 0x20 && c <= 0x2f) {
+        return VC_INTER;
+    }
+    if (c >= 0x40 && c <= 0x7e) {
+        return VC_FINAL;
+    }
+    return VC_OTHER;
+}
+
+// Next decoder state for each state and byte class
+static const unsigned char vtNext[VS_COUNT][VC_COUNT] = {
+    //               ESC       [            O            param     inter     final        other
+    [VS_GROUND] = {VS_ESC,   VS_DISPATCH, VS_DISPATCH, VS_DISPATCH, VS_DISPATCH, VS_DISPATCH, VS_DISPATCH},
+    [VS_ESC]    = {VS_ABORT, VS_CSI,      VS_SS3,      VS_ABORT,  VS_ABORT, VS_ABORT,    VS_ABORT},
+    [VS_CSI]    = {VS_ABORT, VS_DISPATCH, VS_DISPATCH, VS_CSI,    VS_CSI,   VS_DISPATCH, VS_ABORT},
+    [VS_SS3]    = {VS_ABORT, VS_DISPATCH, VS_DISPATCH, VS_SS3,    VS_ABORT, VS_DISPATCH, VS_ABORT},
+};
+
+// Keys for the final byte of CSI and SS3 sequences that have one
+int vtLetterKey(char final) {
+    switch (final) {
+        case 'A': return ARROW_UP;
+        case 'B': return ARROW_DOWN;
+        case 'C': return ARROW_RIGHT;
+        case 'D': return ARROW_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+    }
+    return 0;
+}
+
+// Keys for the number of CSI sequences ending in '~'
+int vtTildeKey(int code) {
+    switch (code) {
+        case 1: return HOME_KEY;
+        case 3: return DEL_KEY;
+        case 4: return END_KEY;
+        case 5: return PAGE_UP;
+        case 6: return PAGE_DOWN;
+        case 7: return HOME_KEY;
+        case 8: return END_KEY;
+        case 200: return PASTE_START;
+        case 201: return PASTE_END;
+    }
+    return 0;
+}
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+// Turn a complete escape sequence into a key, or '\x1b' if it is not known
+int vtDispatch(struct vtseq* seq) {
+    int key = 0;
+    // xterm sends modifiers as 1 + (shift | alt << 1 | ctrl << 2)
+    int mod = seq->nparams > 1 ? seq->params[1] - 1 : 0;
+
+    if (seq->intro == 'O') {
+        key = vtLetterKey(seq->final);
+        mod = seq->nparams > 0 ? seq->params[0] - 1 : 0;
+    } else if (seq->prefix == '<' && (seq->final == 'M' || seq->final == 'm')) {
+        // SGR mouse report: button;column;row, released if the final is 'm'
+        if (seq->nparams < 3) {
             return '\x1b';
         }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        E.mouse.button = seq->params[0];
+        E.mouse.x = seq->params[1] - 1;
+        E.mouse.y = seq->params[2] - 1;
+        E.mouse.press = seq->final == 'M';
+        return MOUSE_EVENT;
+    } else if (seq->prefix == 0 && seq->nparams == 0 && seq->final == 'I') {
+        return FOCUS_IN;
+    } else if (seq->prefix == 0 && seq->nparams == 0 && seq->final == 'O') {
+        return FOCUS_OUT;
+    } else if (seq->prefix == 0 && seq->final == '~') {
+        key = vtTildeKey(seq->nparams > 0 ? seq->params[0] : 0);
+    } else if (seq->prefix == 0) {
+        key = vtLetterKey(seq->final);
+    }
+
+    if (key == 0) {
+        return '\x1b';
+    }
+    if (mod > 0 && mod < 8) {
+        key |= mod * KEY_SHIFT;
+    }
+    return key;
+}
+
+// Return keypresses from the terminal
+// Escape sequences are decoded by a state machine straight from the input
+// ring; more input is only read when a sequence is split across reads
+int editorReadKey(void) {
+    // Sleep until input is ready, using the time between keypresses
+    // for deferred work
+    while (!editorInputPending()) {
+        editorWait();
+        editorFillInput();
+    }
+
+    struct vtseq seq;
+    seq.intro = 0;
+    seq.prefix = 0;
+    seq.nparams = 0;
+    seq.final = 0;
+    int param = -1;
+
+    int state = VS_GROUND;
+    unsigned int n = 0;
+    while (1) {
+        // Wait up to the VTIME timeout for the rest of a sequence
+        if (E.in.tail + n == E.in.head && editorFillInput() == 0) {
+            // A lone ESC is the escape key; drop the rest of a partial sequence
+            E.in.tail += n;
             return '\x1b';
         }
+        unsigned char c = E.in.buf[(E.in.tail + n) & (KILO_INPUT_BUF - 1)];
 
-        // Return correct arrow key based on contents of escape sequence
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-                    return '\x1b';
-                }
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                    case 'A': return ARROW_UP;
-                    case 'B': return ARROW_DOWN;
-                    case 'C': return ARROW_RIGHT;
-                    case 'D': return ARROW_LEFT;
-                    case 'H': return HOME_KEY;
-                    case 'F': return END_KEY;
-                }
+        int next = vtNext[state][vtClassOf(c)];
+        if (next == VS_ABORT) {
+            // Keep an ESC that interrupts a sequence, since it starts the next one
+            E.in.tail += (c == '\x1b') ? n : n + 1;
+            return '\x1b';
+        }
+        n++;
+        if (next == VS_DISPATCH) {
+            E.in.tail += n;
+            if (state == VS_GROUND) {
+                return (char)c;
             }
-        } else if (seq[0] == 'O') {
-            switch (seq[1]) {
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
+            if (param >= 0 && seq.nparams < KILO_VT_PARAMS) {
+                seq.params[seq.nparams++] = param;
             }
+            seq.final = c;
+            return vtDispatch(&seq);
         }
 
-        return '\x1b';
-    } else {
-        return c;
+        // Collect parameters: digits separated by ';', after an optional
+        // private prefix such as '<' or '?'
+        if (state == VS_ESC) {
+            seq.intro = c;
+        } else if (c >= '0' && c <= '9') {
+            param = (param < 0 ? 0 : param * 10) + (c - '0');
+            if (param > 65535) {
+                param = 65535;
+            }
+        } else if (c == ';') {
+            if (seq.nparams < KILO_VT_PARAMS) {
+                seq.params[seq.nparams++] = param < 0 ? 0 : param;
+            }
+            param = 0;
+        } else if (c >= 0x3c && c <= 0x3f && n == 3 && state == VS_CSI) {
+            seq.prefix = c;
+        }
+        state = next;
     }
 }
 
+// Ask the terminal where the cursor is and wait for its reply
 int getCursorPosition(int* rows, int* cols) {
     char buf[32];
     unsigned int i = 0;
 
-    // 
+    // Request a cursor position report
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
         return -1;
     }
@@ -269,28 +818,179 @@ int getCursorPosition(int* rows, int* cols) {
 
     buf[i] = '\0';
     
-    // 
+    // Parse the reply, which has the form ESC [ rows ; cols R
     if (buf[0] != '\x1b' || buf[1] != '[') return -1;
     if (sscanf(&buf[2], "%d;%d", rows, cols) != 2) return -1;
 
-    return -1;
+    return 0;
 }
 
-int getWindowSize(int* rows, int* cols) {
+// Get the window size from the terminal driver, without any terminal I/O
+int getWindowSizeIoctl(int* rows, int* cols) {
     struct winsize ws;
-    // Easy way: Get the number of rows and cols from the terminal controller
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        return -1;
+    }
+    *rows = ws.ws_row;
+    *cols = ws.ws_col;
+    return 0;
+}
+
+int getWindowSize(int* rows, int* cols) {
+    // Easy way: Get the number of rows and cols from the terminal controller
+    if (getWindowSizeIoctl(rows, cols) == -1) {
         // Hard way: Attempt to move the cursor to bottom-right corner, or exit on failure
         if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) {
             return -1;
         }
         // Return cursor position
         return getCursorPosition(rows, cols);
+    }
+    return 0;
+}
+
+/*** text storage ***/
+
+// Hand a block a row owned over to the add buffer, after which it is never
+// modified; its spare room is not reused
+void textAdopt(struct addblock* blk) {
+    blk->len = blk->cap;
+    if (E.text.add == NULL) {
+        blk->next = NULL;
+        E.text.add = blk;
     } else {
-        *rows = ws.ws_row;
-        *cols = ws.ws_col;
-        return 0;
+        // Behind the most recent block, which may still have room
+        blk->next = E.text.add->next;
+        E.text.add->next = blk;
+    }
+}
+
+// Reserve len bytes at the end of the add buffer and return a pointer to them
+// Previously appended bytes are never modified or moved
+char* textAlloc(size_t len) {
+    struct addblock* blk = E.text.add;
+    if (blk == NULL || blk->cap - blk->len < len) {
+        size_t cap = len > KILO_ADD_BLOCK ? len : KILO_ADD_BLOCK;
+        blk = malloc(sizeof(struct addblock) + cap);
+        if (blk == NULL) {
+            die("malloc");
+        }
+        blk->next = E.text.add;
+        blk->cap = cap;
+        blk->len = 0;
+        E.text.add = blk;
+    }
+    char* p = &blk->data[blk->len];
+    blk->len += len;
+    return p;
+}
+
+// Return where len more bytes can be appended directly after the piece
+// [p, p + plen) without copying it, or NULL if the piece is not at the end
+// of the add buffer or the current block is full
+char* textExtend(const char* p, size_t plen, size_t len) {
+    struct addblock* blk = E.text.add;
+    if (blk == NULL || p + plen != &blk->data[blk->len] || blk->cap - blk->len < len) {
+        return NULL;
+    }
+    return textAlloc(len);
+}
+
+// Release the original buffer and every add buffer block of a piece table
+void textRelease(struct textbuf* text) {
+    if (text->orig_mapped) {
+        munmap(text->orig, text->origlen);
+    } else {
+        free(text->orig);
+    }
+    text->orig = NULL;
+    text->origlen = 0;
+    text->orig_mapped = 0;
+
+    while (text->add) {
+        struct addblock* next = text->add->next;
+        free(text->add);
+        text->add = next;
+    }
+}
+
+// Release the document's text storage
+void textFree(void) {
+    textRelease(&E.text);
+}
+
+// Release a piece table handed over by textFreeLater()
+void* textReleaseThread(void* arg) {
+    textRelease(arg);
+    free(arg);
+    return NULL;
+}
+
+// Release the document's text storage on a detached thread
+// Unmapping a large file that a save just renamed over drops its page
+// cache, which can take seconds
+void textFreeLater(void) {
+    struct textbuf* old = malloc(sizeof(struct textbuf));
+    pthread_t thread;
+    if (old == NULL) {
+        textFree();
+        return;
+    }
+    *old = E.text;
+    if (pthread_create(&thread, NULL, textReleaseThread, old) != 0) {
+        free(old);
+        textFree();
+        return;
+    }
+    pthread_detach(thread);
+    E.text.orig = NULL;
+    E.text.origlen = 0;
+    E.text.orig_mapped = 0;
+    E.text.add = NULL;
+}
+
+// Return the row at an index, skipping over the gap in the row buffer
+// The pointer is invalidated by inserting or deleting rows
+erow* editorRowAt(int at) {
+    return &E.row[at < E.gap ? at : at + (E.rowcap - E.numrows)];
+}
+
+// Return the index of a row from its slot in the row buffer
+// Positions are implicit, so inserting or deleting rows renumbers nothing
+int editorRowIndex(erow* row) {
+    int slot = row - E.row;
+    return slot < E.gap ? slot : slot - (E.rowcap - E.numrows);
+}
+
+// Move the gap in the row buffer so that it starts at an index
+void editorMoveGap(int at) {
+    int gaplen = E.rowcap - E.numrows;
+    if (at < E.gap) {
+        memmove(&E.row[at + gaplen], &E.row[at], sizeof(erow) * (E.gap - at));
+    } else if (at > E.gap) {
+        memmove(&E.row[E.gap], &E.row[E.gap + gaplen], sizeof(erow) * (at - E.gap));
+    }
+    E.gap = at;
+}
+
+// Make room for at least n more rows, growing the row buffer geometrically
+void editorReserveRows(int n) {
+    if (E.rowcap - E.numrows >= n) {
+        return;
+    }
+    int newcap = E.rowcap ? E.rowcap * 2 : 16;
+    while (newcap - E.numrows < n) {
+        newcap *= 2;
+    }
+
+    // Move the gap to the end so the rows after it stay in place
+    editorMoveGap(E.numrows);
+    erow* new = realloc(E.row, sizeof(erow) * newcap);
+    if (new == NULL) {
+        die("realloc");
     }
+    E.row = new;
+    E.rowcap = newcap;
 }
 
 /*** syntax highlighting ***/
@@ -299,42 +999,119 @@ int is_separator(int c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-// Update highlighting for all characters
-void editorUpdateSyntax(erow* row) {
-    // Reallocate memory to account for changes since last highlight pass
-    row->hl = realloc(row->hl, row->rsize);
+// Return the hash table slot index for a word
+unsigned int editorSyntaxHash(const char* s, int len) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) s[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Return the keyword table slot holding a word, or NULL if it is not a keyword
+struct keyword* editorSyntaxKeyword(struct syntaxTables* t, const char* s, int len) {
+    if (len < t->kw_minlen || len > t->kw_maxlen || len == 0) {
+        return NULL;
+    }
+    unsigned int h = editorSyntaxHash(s, len) & t->kw_mask;
+    while (t->kw[h].word) {
+        if (t->kw[h].len == len && !memcmp(t->kw[h].word, s, len)) {
+            return &t->kw[h];
+        }
+        h = (h + 1) & t->kw_mask;
+    }
+    return NULL;
+}
+
+// Build the comment delimiter lengths and keyword hash table of a syntax
+struct syntaxTables* editorSyntaxCompile(struct editorSyntax* syntax) {
+    int count = 0;
+    while (syntax->keywords[count]) {
+        count++;
+    }
+    // Keep the table at most half full so probe sequences stay short
+    unsigned int size = 16;
+    while (size < 2 * (unsigned int) count) {
+        size *= 2;
+    }
+
+    struct syntaxTables* t = calloc(1, sizeof(struct syntaxTables) + size * sizeof(struct keyword));
+    if (t == NULL) {
+        die("calloc");
+    }
+    t->scs_len = syntax->singleline_comment_start ? strlen(syntax->singleline_comment_start) : 0;
+    t->mcs_len = syntax->multiline_comment_start ? strlen(syntax->multiline_comment_start) : 0;
+    t->mce_len = syntax->multiline_comment_end ? strlen(syntax->multiline_comment_end) : 0;
+    t->kw_mask = size - 1;
+    t->kw_minlen = count ? INT_MAX : 0;
+
+    for (int j = 0; j < count; j++) {
+        const char* word = syntax->keywords[j];
+        int klen = strlen(word);
+        // Keywords ending in '|' are secondary keywords
+        int kw2 = word[klen - 1] == '|';
+        if (kw2) {
+            klen--;
+        }
+        if (editorSyntaxKeyword(t, word, klen)) {
+            continue;
+        }
+
+        unsigned int h = editorSyntaxHash(word, klen) & t->kw_mask;
+        while (t->kw[h].word) {
+            h = (h + 1) & t->kw_mask;
+        }
+        t->kw[h].word = word;
+        t->kw[h].len = klen;
+        t->kw[h].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+
+        if (klen < t->kw_minlen) {
+            t->kw_minlen = klen;
+        }
+        if (klen > t->kw_maxlen) {
+            t->kw_maxlen = klen;
+        }
+    }
+    return t;
+}
+
+// Highlight len characters of s into hl, starting inside a multiline comment
+// if in_comment is set. Return whether the text ends inside a multiline comment
+// Lexing works on a row's chars rather than its render, so the comment state
+// of rows that have never been drawn can be found without rendering them
+int editorSyntaxLex(const char* s, int len, unsigned char* hl, int in_comment) {
     // Set all characters to normal
-    memset(row->hl, HL_NORMAL, row->rsize);
+    memset(hl, HL_NORMAL, len);
 
     if (E.syntax == NULL) {
-        return;
+        return 0;
     }
 
-    char** keywords = E.syntax->keywords;
+    struct syntaxTables* t = E.syntax->tables;
 
     // Check for comments
     char* scs = E.syntax->singleline_comment_start;
     char* mcs = E.syntax->multiline_comment_start;
     char* mce = E.syntax->multiline_comment_end;
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+    int scs_len = t->scs_len;
+    int mcs_len = t->mcs_len;
+    int mce_len = t->mce_len;
 
     int prev_sep = 1;
     int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
 
     // Set highlighting for non-normal characters
     int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    while (i < len) {
+        char c = s[i];
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
 
         // Highlight single-line comments
         if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+            if (i + scs_len <= len && !memcmp(&s[i], scs, scs_len)) {
+                memset(&hl[i], HL_COMMENT, len - i);
                 break;
             }
         }
@@ -342,9 +1119,9 @@ void editorUpdateSyntax(erow* row) {
         // Highlight multiline comments
         if (mcs_len && mce_len && !in_string) {
             if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+                hl[i] = HL_MLCOMMENT;
+                if (i + mce_len <= len && !memcmp(&s[i], mce, mce_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
                     i += mce_len;
                     in_comment = 0;
                     prev_sep = 1;
@@ -353,8 +1130,8 @@ void editorUpdateSyntax(erow* row) {
                     i++;
                     continue;
                 }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+            } else if (i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len)) {
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
                 i += mcs_len;
                 in_comment = 1;
                 continue;
@@ -364,10 +1141,10 @@ void editorUpdateSyntax(erow* row) {
         // Highlight strings if enabled for this file type
         if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
             if (in_string) {
-                row->hl[i] = HL_STRING;
+                hl[i] = HL_STRING;
                 // Highlight through backslashes if string continues
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
+                if (c == '\\' && i + 1 < len) {
+                    hl[i + 1] = HL_STRING;
                     i += 2;
                     continue;
                 }
@@ -381,7 +1158,7 @@ void editorUpdateSyntax(erow* row) {
                 // Highlight single- and double-quoted strings
                 if (c == '"' || c == '\'') {
                     in_string = c;
-                    row->hl[i] = HL_STRING;
+                    hl[i] = HL_STRING;
                     i++;
                     continue;
                 }
@@ -394,34 +1171,26 @@ void editorUpdateSyntax(erow* row) {
             // or are part of a decimal number (including decimal point)
             if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || 
                 (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
+                hl[i] = HL_NUMBER;
                 i++;
                 prev_sep = 0;
                 continue;
             }
         }
 
-        // If the previous character was a separator, compare this word to each
-        // word in the list of keywords, and highlight if it is a keyword
+        // If the previous character was a separator, look the word starting
+        // here up in the keyword table, and highlight if it is a keyword
         if (prev_sep) {
-            int j;
-            // Loop through each keyword and compare the correct number of characters
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) {
-                    klen--;
-                }
-
-                // If it is a keyword, highlight the entire word at once
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                        is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
+            int wlen = 0;
+            while (i + wlen < len && wlen <= t->kw_maxlen && !is_separator(s[i + wlen])) {
+                wlen++;
             }
-            if (keywords[j] != NULL) {
+
+            // If it is a keyword, highlight the entire word at once
+            struct keyword* kw = editorSyntaxKeyword(t, &s[i], wlen);
+            if (kw) {
+                memset(&hl[i], kw->hl, wlen);
+                i += wlen;
                 prev_sep = 0;
                 continue;
             }
@@ -431,11 +1200,110 @@ void editorUpdateSyntax(erow* row) {
         i++;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows) {
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    return in_comment;
+}
+
+// Return a scratch highlight buffer of at least len bytes
+unsigned char* editorSyntaxScratch(int len) {
+    static unsigned char* scratch = NULL;
+    static int scratchcap = 0;
+
+    if (len > scratchcap) {
+        scratchcap = len > 2 * scratchcap ? len : 2 * scratchcap;
+        free(scratch);
+        scratch = malloc(scratchcap);
+        if (scratch == NULL) {
+            die("malloc");
+        }
+    }
+    return scratch;
+}
+
+// Return the lexer state at the end of the row before a row index
+// Past the known prefix this is the last state computed, which may be stale
+int editorSyntaxPrevState(int at) {
+    return at > 0 ? editorRowAt(at - 1)->hl_open_comment : 0;
+}
+
+// Record that rows from..to may no longer follow on from the rows before them
+// Nothing is lexed here; the known prefix is cut back and caught up later
+void editorSyntaxInvalidate(int from, int to) {
+    if (from < E.syntaxrows) {
+        E.syntaxrows = from;
+    }
+    if (to >= E.numrows) {
+        to = E.numrows - 1;
+    }
+    if (to > E.syntaxdirty) {
+        E.syntaxdirty = to;
+    }
+}
+
+// Advance the known prefix by up to max rows, lexing only rows whose start
+// state differs from the state they were last lexed from
+// Return whether a row on screen has to be drawn again
+int editorSyntaxStep(int max) {
+    int redraw = 0;
+    while (max-- > 0 && E.syntaxrows < E.numrows) {
+        int at = E.syntaxrows;
+        erow* row = editorRowAt(at);
+        int start = editorSyntaxPrevState(at);
+
+        if (row->hl_start == start) {
+            // Every row after the last invalidated one was consistent with
+            // its predecessor, so once the states converge there the rest
+            // of the file is known too
+            if (at > E.syntaxdirty) {
+                E.syntaxrows = E.numrows;
+                break;
+            }
+        } else {
+            unsigned char* hl = editorSyntaxScratch(row->size);
+            row->hl_open_comment = editorSyntaxLex(row->chars, row->size, hl, start);
+            row->hl_start = start;
+            // A rendered row was highlighted from the old state
+            if (row->render) {
+                free(row->render);
+                row->render = NULL;
+                row->hl = NULL;
+                if (at >= E.rowoff && at < E.rowoff + E.screenrows) {
+                    redraw = 1;
+                }
+            }
+        }
+        E.syntaxrows++;
+    }
+
+    if (E.syntaxrows == E.numrows) {
+        E.syntaxdirty = -1;
+    }
+    return redraw;
+}
+
+// Update highlighting after a row changed
+// The rendered row is dropped and it is lexed again when it is drawn or when
+// the known prefix catches up with it
+void editorUpdateSyntax(erow* row) {
+    free(row->render);
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_start = -1;
+
+    int at = editorRowIndex(row);
+    editorSyntaxInvalidate(at, at);
+}
+
+// Forget all rendered rows and lexer states, e.g. after the syntax changed
+void editorInvalidateSyntax(void) {
+    for (int j = 0; j < E.numrows; j++) {
+        erow* row = editorRowAt(j);
+        free(row->render);
+        row->render = NULL;
+        row->hl = NULL;
+        row->hl_start = -1;
     }
+    E.syntaxrows = 0;
+    E.syntaxdirty = E.numrows - 1;
 }
 
 // Return corresponding color for syntax
@@ -455,6 +1323,8 @@ int editorSyntaxToColor(int hl) {
 // Match the current filename to a matching type in the HLDB
 void editorSelectSyntaxHighlight(void) {
     E.syntax = NULL;
+    // Rows are highlighted again as they are drawn
+    editorInvalidateSyntax();
     if (E.filename == NULL) {
         return;
     }
@@ -469,13 +1339,10 @@ void editorSelectSyntaxHighlight(void) {
             int is_ext = (s->filematch[i][0] == '.');
             if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
                 (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
-
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
+                if (s->tables == NULL) {
+                    s->tables = editorSyntaxCompile(s);
                 }
-
+                E.syntax = s;
                 return;
             }
             i++;
@@ -521,7 +1388,23 @@ int editorRowRxToCx(erow* row, int rx) {
 }
 
 // Updates contents of the current row
+// The render and highlighting are rebuilt by editorRenderRow() when needed
 void editorUpdateRow(erow* row) {
+    editorUpdateSyntax(row);
+}
+
+// Return the row at an index with its render and highlighting built
+// Rows are highlighted from the best known state of the row before them, so
+// rows drawn top to bottom follow on from each other even before the known
+// syntax prefix reaches them
+erow* editorRenderRow(int at) {
+    erow* row = editorRowAt(at);
+    int start = editorSyntaxPrevState(at);
+    if (row->render && row->hl_start == start) {
+        return row;
+    }
+    free(row->render);
+
     int tabs = 0;
     int j;
     // Get count of tabs (to account for extra memory needed when rendering them)
@@ -531,412 +1414,3168 @@ void editorUpdateRow(erow* row) {
         }
     }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+    // Render and highlighting share one allocation
+    int maxsize = row->size + tabs * (KILO_TAB_STOP - 1);
+    row->render = malloc(2 * maxsize + 1);
+    if (row->render == NULL) {
+        die("malloc");
+    }
+    row->hl = (unsigned char*) &row->render[maxsize + 1];
+
+    // Highlight the characters, then spread each class over its rendered columns
+    unsigned char* hl = editorSyntaxScratch(row->size);
+    int end = editorSyntaxLex(row->chars, row->size, hl, start);
+    if (end != row->hl_open_comment) {
+        // The next row no longer follows on from this one
+        editorSyntaxInvalidate(at + 1, at + 1);
+    }
+    row->hl_open_comment = end;
+    row->hl_start = start;
+    if (at == E.syntaxrows) {
+        E.syntaxrows++;
+    }
 
     int idx = 0;
     // Render tabs with proper spacing
     for (j = 0; j < row->size; j++) {
         if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
+            row->render[idx] = ' ';
+            row->hl[idx++] = hl[j];
             while (idx % KILO_TAB_STOP != 0) {
-                row->render[idx++] = ' ';
+                row->render[idx] = ' ';
+                row->hl[idx++] = hl[j];
             }
         } else {
-            row->render[idx++] = row->chars[j];
+            row->render[idx] = row->chars[j];
+            row->hl[idx++] = hl[j];
         }
     }
 
     row->render[idx] = '\0';
     row->rsize = idx;
 
-    editorUpdateSyntax(row);
+    return row;
 }
 
-// Append a row to the current array of rows
-void editorInsertRow(int at, char* s, size_t len) {
-    // Check bounds
-    if (at < 0 || at > E.numrows) {
-        return;
+// Open n empty rows at an index in one step and return the first of them
+// The new rows are contiguous in the row buffer, so callers can point them at
+// their text in place; editorInsertRowsDone() must be called once they are set
+erow* editorInsertRows(int at, int n) {
+    if (n == 0) {
+        return NULL;
     }
-
-    // Reallocate memory for the current row
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    // Move current row to next row index
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j < E.numrows; j++) {
-        E.row[j].idx++;
+    // Open slots for the rows at the start of the gap
+    editorReserveRows(n);
+    editorMoveGap(at);
+    E.gap += n;
+    E.numrows += n;
+
+    erow* rows = editorRowAt(at);
+    for (int j = 0; j < n; j++) {
+        erow* row = &rows[j];
+        row->size = 0;
+        row->rsize = 0;
+        row->chars = "";
+        row->own = NULL;
+        row->render = NULL;
+        row->hl = NULL;
+        row->hl_open_comment = 0;
+        row->hl_start = -1;
     }
+    return rows;
+}
 
-    E.row[at].idx = at;
+// Finish inserting the rows opened by editorInsertRows()
+// Syntax and dirty state are updated once for the whole batch
+void editorInsertRowsDone(int at, int n) {
+    // The new rows and the row after them (which now follows a different
+    // row) are lexed when they are drawn or in idle time
+    if (E.syntaxdirty >= at) {
+        E.syntaxdirty += n;
+    }
+    editorSyntaxInvalidate(at, at + n);
 
-    // Copy the current row char* to the current row in allocated memory
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    E.dirty++;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
+// Insert a row viewing len bytes at s
+// s must point into the text storage (or be a static string), since the row
+// keeps a view of it rather than a copy
+void editorInsertRow(int at, const char* s, size_t len) {
+    // Check bounds
+    if (at < 0 || at > E.numrows) {
+        return;
+    }
 
-    // Update contents of the current row
-    editorUpdateRow(&E.row[at]);
+    erow* row = editorInsertRows(at, 1);
+    row->size = len;
+    row->chars = s;
+    editorInsertRowsDone(at, 1);
+}
 
-    E.numrows++;
-    E.dirty++;
+// Free the block a row owns, before the row is pointed at other text
+void editorRowDisown(erow* row) {
+    free(row->own);
+    row->own = NULL;
 }
 
-// Free memory for a row
+// Free memory for a row (its render, which also holds its highlighting, and
+// the block it owns)
 void editorFreeRow(erow* row) {
     free(row->render);
-    free(row->chars);
-    free(row->hl);
+    row->render = NULL;
+    row->hl = NULL;
+    editorRowDisown(row);
+}
+
+// Make a row own its text, with room for size bytes, so that it can be
+// edited in place. Only the first edit copies the row out of the text
+// storage; the block then grows geometrically like a realloced row would
+void editorRowOwn(erow* row, size_t size) {
+    struct addblock* blk = row->own;
+    if (blk && blk->cap >= size) {
+        return;
+    }
+    size_t cap = blk ? blk->cap * 2 : 16;
+    while (cap < size) {
+        cap *= 2;
+    }
+    if (blk) {
+        blk = realloc(blk, sizeof(struct addblock) + cap);
+    } else {
+        blk = malloc(sizeof(struct addblock) + cap);
+        if (blk) {
+            memcpy(blk->data, row->chars, row->size);
+        }
+    }
+    if (blk == NULL) {
+        die("malloc");
+    }
+    blk->next = NULL;
+    blk->cap = cap;
+    blk->len = 0;
+    row->own = blk;
+    row->chars = blk->data;
+}
+
+// Delete n rows at an index in one step
+void editorDelRows(int at, int n) {
+    // Check bounds
+    if (at < 0 || n <= 0 || at + n > E.numrows) {
+        return;
+    }
+    // Delete rows, then absorb their slots into the gap
+    for (int j = 0; j < n; j++) {
+        editorFreeRow(editorRowAt(at + j));
+    }
+    editorMoveGap(at + n);
+    E.gap -= n;
+    E.numrows -= n;
+
+    // The row that followed the deleted rows now follows a different row
+    if (E.syntaxdirty >= at + n) {
+        E.syntaxdirty -= n;
+    } else if (E.syntaxdirty > at) {
+        E.syntaxdirty = at;
+    }
+    editorSyntaxInvalidate(at, at);
+
+    E.dirty++;
+}
+
+void editorDelRow(int at) {
+    editorDelRows(at, 1);
+}
+
+// Insert a character into a row at an index
+void editorRowInsertChar(erow* row, int at, int c) {
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+    // Typing at the end of a row that is the last piece of the add buffer
+    // only appends, otherwise the character is spliced in the row's own block
+    char* p = (at == row->size && !row->own) ? textExtend(row->chars, row->size, 1) : NULL;
+    if (p) {
+        *p = c;
+    } else {
+        editorRowOwn(row, row->size + 1);
+        p = row->own->data;
+        memmove(&p[at + 1], &p[at], row->size - at);
+        p[at] = c;
+    }
+    row->size++;
+    // Update the row in the editor
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+// Append a string of any size to the end of a row
+void editorRowAppendString(erow* row, const char* s, size_t len) {
+    // Append to the add buffer when possible, otherwise to the row's own block
+    char* p = row->own ? NULL : textExtend(row->chars, row->size, len);
+    if (p == NULL) {
+        editorRowOwn(row, row->size + len);
+        p = &row->own->data[row->size];
+    }
+    memcpy(p, s, len);
+    row->size += len;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+// Delete a character from a row at an index
+void editorRowDelChar(erow* row, int at) {
+    if (at < 0 || at >= row->size) {
+        return;
+    }
+    // Deleting at either end of a view only narrows it, otherwise the
+    // character is cut out of the row's own block
+    if (at == 0 && !row->own) {
+        row->chars++;
+    } else if (at != row->size - 1) {
+        editorRowOwn(row, row->size);
+        char* p = row->own->data;
+        memmove(&p[at], &p[at + 1], row->size - at - 1);
+    }
+    // Shrink row size and update row
+    row->size--;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+/*** undo ***/
+
+// Start hashing a text of len bytes with hashAdd()
+void hashInit(struct hasher* hs, size_t len) {
+    hs->h = 14695981039346656037ull ^ len;
+    hs->n = 0;
+}
+
+void hashWord(struct hasher* hs, const char* s) {
+    uint64_t w;
+    memcpy(&w, s, 8);
+    hs->h = (hs->h ^ w) * 1099511628211ull;
+    hs->h ^= hs->h >> 29;
+}
+
+// Mix in a word at a time; bytes short of a word wait for the next piece
+void hashAdd(struct hasher* hs, const char* s, size_t len) {
+    size_t i = 0;
+    if (hs->n > 0) {
+        while (hs->n < 8 && i < len) {
+            hs->word[hs->n++] = s[i++];
+        }
+        if (hs->n < 8) {
+            return;
+        }
+        hashWord(hs, hs->word);
+        hs->n = 0;
+    }
+    for (; i + 8 <= len; i += 8) {
+        hashWord(hs, &s[i]);
+    }
+    for (; i < len; i++) {
+        hs->word[hs->n++] = s[i];
+    }
+}
+
+// Mix in the remaining bytes one at a time and return the hash
+uint64_t hashEnd(struct hasher* hs) {
+    for (int i = 0; i < hs->n; i++) {
+        hs->h = (hs->h ^ (unsigned char) hs->word[i]) * 1099511628211ull;
+    }
+    return hs->h;
+}
+
+// Return a hash of a document's contents, used to tell whether an undo
+// file still applies to it
+uint64_t editorHash(const char* s, size_t len) {
+    struct hasher hs;
+    hashInit(&hs, len);
+    hashAdd(&hs, s, len);
+    return hashEnd(&hs);
+}
+
+// Return a file's modification time in nanoseconds
+int64_t editorMtime(struct stat* st) {
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Return the path of the undo file of a document, or NULL if it has none
+// Undo files are kept out of the document's directory, in kilo/undo under
+// $XDG_STATE_HOME (by default ~/.local/state), which is created if needed,
+// and are named after the document and a hash of its full path
+char* editorUndoPath(const char* filename) {
+    char dir[PATH_MAX];
+    const char* state = getenv("XDG_STATE_HOME");
+    const char* home = getenv("HOME");
+    if (state && state[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/kilo/undo", state);
+    } else if (home && home[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s/.local/state/kilo/undo", home);
+    } else {
+        return NULL;
+    }
+    for (char* p = &dir[1]; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+                return NULL;
+            }
+            *p = c;
+            if (c == '\0') {
+                break;
+            }
+        }
+    }
+
+    char* full = realpath(filename, NULL);
+    if (full == NULL) {
+        return NULL;
+    }
+    size_t size = strlen(dir) + 224;
+    char* path = malloc(size);
+    if (path == NULL) {
+        die("malloc");
+    }
+    snprintf(path, size, "%s/%.200s.%016llx.undo", dir, strrchr(full, '/') + 1,
+        (unsigned long long) editorHash(full, strlen(full)));
+    free(full);
+    return path;
+}
+
+// Open (creating if needed) the undo file of the document
+// Return whether it is open; unnamed documents have no undo file
+int editorUndoOpenFile(void) {
+    struct undolog* u = &E.undo;
+    if (u->fd == -1 && E.filename) {
+        if (u->path == NULL) {
+            u->path = editorUndoPath(E.filename);
+        }
+        if (u->path) {
+            u->fd = open(u->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        }
+    }
+    return u->fd != -1;
+}
+
+// Close the undo file on exit, removing it if it holds no history that
+// could be reloaded: none was recorded, or the document was never saved
+// with it
+void editorUndoClose(void) {
+    struct undolog* u = &E.undo;
+    if (u->fd == -1) {
+        return;
+    }
+    if (u->len == 0 || u->synced == 0) {
+        unlink(u->path);
+    }
+    close(u->fd);
+    u->fd = -1;
+}
+
+// Write the log from an offset up to another to the undo file
+// Return whether it was written
+int undoWrite(size_t from, size_t to) {
+    struct undolog* u = &E.undo;
+    // The header no longer describes the log once part of it is rewritten
+    if (from < u->synced) {
+        struct undofile h;
+        memset(&h, 0, sizeof(h));
+        if (pwrite(u->fd, &h, sizeof(h), 0) != sizeof(h)) {
+            return 0;
+        }
+        u->synced = 0;
+    }
+    while (from < to) {
+        ssize_t n = pwrite(u->fd, &u->buf[from - u->base], to - from, sizeof(struct undofile) + from);
+        if (n <= 0) {
+            return 0;
+        }
+        from += n;
+    }
+    return 1;
+}
+
+// Return the size of an undo record including its padding
+size_t undoRecordSize(struct undorec* r) {
+    size_t size = sizeof(struct undorec) + r->nold + r->nnew;
+    return (size + 7) & ~(size_t) 7;
+}
+
+// Return the undo record at an offset of the undo log, reading it back from
+// the undo file if it was spilled, or NULL if that fails
+// The pointer is invalidated by appending to the log or by reading back
+// another record
+struct undorec* undoRecord(size_t off) {
+    struct undolog* u = &E.undo;
+    if (off >= u->base) {
+        return (struct undorec*) &u->buf[off - u->base];
+    }
+
+    struct undorec r;
+    off_t pos = sizeof(struct undofile) + off;
+    if (pread(u->fd, &r, sizeof(r), pos) != sizeof(r)) {
+        return NULL;
+    }
+    size_t size = undoRecordSize(&r);
+    if (size > u->scratchcap) {
+        free(u->scratch);
+        u->scratch = malloc(size);
+        if (u->scratch == NULL) {
+            die("malloc");
+        }
+        u->scratchcap = size;
+    }
+    if (pread(u->fd, u->scratch, size, pos) != (ssize_t) size) {
+        return NULL;
+    }
+    return (struct undorec*) u->scratch;
+}
+
+// Append n bytes to the undo log
+void undoAppend(const void* p, size_t n) {
+    struct undolog* u = &E.undo;
+    size_t used = u->len - u->base;
+    if (u->cap - used < n) {
+        size_t cap = u->cap ? u->cap : KILO_ADD_BLOCK;
+        while (cap - used < n) {
+            cap *= 2;
+        }
+        u->buf = realloc(u->buf, cap);
+        if (u->buf == NULL) {
+            die("realloc");
+        }
+        u->cap = cap;
+    }
+    memcpy(&u->buf[used], p, n);
+    u->len += n;
+}
+
+// Keep the log in memory under KILO_UNDO_MEM by moving its oldest records
+// to the undo file
+// The last record stays in memory so that typing can still be merged into it
+void editorUndoSpill(void) {
+    struct undolog* u = &E.undo;
+    if (u->len - u->base <= KILO_UNDO_MEM || u->last == UNDO_NONE || !editorUndoOpenFile()) {
+        return;
+    }
+    // Spill whole records until half of the budget is left
+    size_t cut = u->base;
+    while (cut < u->last && u->len - cut > KILO_UNDO_MEM / 2) {
+        cut += undoRecordSize(undoRecord(cut));
+    }
+    if (cut == u->base || !undoWrite(u->base, cut)) {
+        return;
+    }
+    memmove(u->buf, &u->buf[cut - u->base], u->len - cut);
+    u->base = cut;
+}
+
+// Write the log to the undo file once the document has been saved as a file
+// with a status and a hash of its contents, so the history can be reloaded
+// with it
+void editorUndoSync(uint64_t hash, struct stat* st) {
+    struct undolog* u = &E.undo;
+    if (u->len == 0 && u->fd == -1) {
+        return;
+    }
+    if (!editorUndoOpenFile() || !undoWrite(u->base, u->len)) {
+        return;
+    }
+    struct undofile h;
+    memcpy(h.magic, UNDO_MAGIC, sizeof(h.magic));
+    h.hash = hash;
+    h.size = st->st_size;
+    h.ino = st->st_ino;
+    h.dev = st->st_dev;
+    h.mtime = editorMtime(st);
+    h.len = u->len;
+    h.top = u->top;
+    h.last = u->last;
+    h.group = u->group;
+    if (pwrite(u->fd, &h, sizeof(h), 0) == sizeof(h) &&
+        ftruncate(u->fd, sizeof(h) + u->len) == 0) {
+        u->synced = u->len;
+    }
+}
+
+// Pick up the history in the undo file of a document just opened with a
+// status, if it was written for the same contents; otherwise the file is
+// removed
+// The document is only hashed if it is the same size but was touched since
+// The whole log stays on disk until records are undone
+void editorUndoLoad(struct stat* st) {
+    struct undolog* u = &E.undo;
+    free(u->path);
+    u->path = editorUndoPath(E.filename);
+    u->fd = u->path ? open(u->path, O_RDWR | O_CLOEXEC) : -1;
+    if (u->fd == -1) {
+        return;
+    }
+
+    struct undofile h;
+    int ok = pread(u->fd, &h, sizeof(h), 0) == sizeof(h) &&
+        memcmp(h.magic, UNDO_MAGIC, sizeof(h.magic)) == 0 &&
+        h.size == (uint64_t) E.text.origlen;
+    if (ok && (h.ino != (uint64_t) st->st_ino || h.dev != (uint64_t) st->st_dev ||
+        h.mtime != editorMtime(st))) {
+        ok = h.hash == editorHash(E.text.orig, E.text.origlen);
+    }
+    if (!ok) {
+        unlink(u->path);
+        close(u->fd);
+        u->fd = -1;
+        return;
+    }
+    u->base = h.len;
+    u->len = h.len;
+    u->top = h.top;
+    u->last = h.last;
+    u->synced = h.len;
+    // Keep new commands out of the groups in the file
+    u->group = h.group + 1;
+}
+
+// Append the text of the document from one position up to another to the
+// undo log, with a '\n' after each row
+// A position past the last row is only valid at column 0
+// Return the number of bytes
+size_t undoAppendText(int at, int col, int torow, int tocol) {
+    size_t bytes = 0;
+    for (int j = at; j <= torow && j < E.numrows; j++) {
+        erow* row = editorRowAt(j);
+        int from = (j == at) ? col : 0;
+        int to = (j == torow) ? tocol : row->size;
+        undoAppend(&row->chars[from], to - from);
+        bytes += to - from;
+        if (j < torow) {
+            undoAppend("\n", 1);
+            bytes++;
+        }
+    }
+    return bytes;
+}
+
+// Record the text from row at, column col up to row torow, column tocol
+// before an edit replaces it
+// A typing edit that carries on where the last record's inserted text ends,
+// or a deleting edit that ends where its removed text starts, is merged
+// into that record, which is the last one in the log
+void editorUndoBegin(int at, int col, int torow, int tocol, int kind) {
+    struct undolog* u = &E.undo;
+    // A new edit drops the edits that were undone
+    u->len = u->top;
+    if (u->base > u->len) {
+        u->base = u->len;
+    }
+    u->at = at;
+    u->col = col;
+    u->eol = 0;
+
+    if (kind != UNDO_EDIT && u->last != UNDO_NONE && u->last >= u->base) {
+        struct undorec* r = undoRecord(u->last);
+        const char* text = (const char*) &r[1];
+        if (r->kind == kind && r->ncy == E.cy && r->ncx == E.cx) {
+            // Typed text has no line breaks, except after the first key
+            // typed on a new last row
+            int eol = r->nnew > 0 && text[r->nold + r->nnew - 1] == '\n';
+            if (kind == UNDO_TYPE && r->at == at && r->col + (int) r->nnew - eol == col) {
+                // Reopen the record to append to its inserted text
+                u->open = u->last;
+                u->len = u->last + sizeof(struct undorec) + r->nold + r->nnew - eol;
+                r->nnew -= eol;
+                u->eol = eol;
+                return;
+            }
+            if (kind == UNDO_DELETE && r->at == torow && r->col == tocol && r->nnew == 0) {
+                // Append the removed text, then rotate it in front of the
+                // text the record already removed
+                u->open = u->last;
+                u->len = u->last + sizeof(struct undorec) + r->nold;
+                size_t nold = r->nold;
+                size_t bytes = undoAppendText(at, col, torow, tocol);
+                r = undoRecord(u->open);
+                char* old = (char*) &r[1];
+                char* removed = malloc(bytes);
+                if (removed == NULL) {
+                    die("malloc");
+                }
+                memcpy(removed, &old[nold], bytes);
+                memmove(&old[bytes], old, nold);
+                memcpy(old, removed, bytes);
+                free(removed);
+                r->nold += bytes;
+                r->at = at;
+                r->col = col;
+                return;
+            }
+        }
+    }
+
+    struct undorec r;
+    r.prev = u->last;
+    r.nold = 0;
+    r.nnew = 0;
+    r.kind = kind;
+    r.group = u->group;
+    r.at = at;
+    r.col = col;
+    r.cy = E.cy;
+    r.cx = E.cx;
+    u->open = u->len;
+    undoAppend(&r, sizeof(r));
+    size_t bytes = undoAppendText(at, col, torow, tocol);
+    undoRecord(u->open)->nold = bytes;
+}
+// Finish the record opened by editorUndoBegin() once the edit has put the
+// text up to row torow, column tocol in place of the old text, and moved
+// the cursor
+void editorUndoEnd(int torow, int tocol) {
+    struct undolog* u = &E.undo;
+    if (u->open == UNDO_NONE) {
+        return;
+    }
+    size_t bytes = undoAppendText(u->at, u->col, torow, tocol);
+    if (u->eol) {
+        undoAppend("\n", 1);
+        bytes++;
+    }
+
+    struct undorec* r = undoRecord(u->open);
+    r->nnew += bytes;
+    r->ncy = E.cy;
+    r->ncx = E.cx;
+    static const char pad[8];
+    undoAppend(pad, u->open + undoRecordSize(r) - u->len);
+
+    u->last = u->open;
+    u->top = u->len;
+    u->open = UNDO_NONE;
+    editorUndoSpill();
+}
+
+// Undo (or with redo set, redo) the edit of a record
+// The rows the text to remove touches are replaced in one splice by rows
+// viewing a single copy of their new text in the text storage
+void editorUndoApply(struct undorec* r, int redo) {
+    size_t remove = redo ? r->nold : r->nnew;
+    size_t bytes = redo ? r->nnew : r->nold;
+    const char* text = (const char*) &r[1];
+    if (redo) {
+        text += r->nold;
+    }
+
+    // Find where the text to remove ends
+    int torow = r->at;
+    int tocol = r->col;
+    while (remove > 0) {
+        size_t left = editorRowAt(torow)->size - tocol;
+        if (remove <= left) {
+            tocol += remove;
+            break;
+        }
+        remove -= left + 1;
+        torow++;
+        tocol = 0;
+    }
+
+    // The rows keep their text before the edit and after the removed text,
+    // unless the removed text runs to the end of the document
+    int toend = torow == E.numrows;
+    erow* first = toend && r->at == E.numrows ? NULL : editorRowAt(r->at);
+    erow* last = toend ? NULL : editorRowAt(torow);
+    size_t prefix = first ? (size_t) r->col : 0;
+    size_t suffix = last ? last->size - tocol : 0;
+    size_t total = prefix + bytes + suffix;
+    char* p = textAlloc(total);
+    if (first) {
+        memcpy(p, first->chars, prefix);
+    }
+    memcpy(&p[prefix], text, bytes);
+    if (last) {
+        memcpy(&p[prefix + bytes], &last->chars[tocol], suffix);
+    }
+
+    // The new text has a row for each line break, and one more for the
+    // rest of the row unless it reaches the end of the document
+    int breaks = 0;
+    for (size_t j = 0; j < bytes; j++) {
+        if (text[j] == '\n') {
+            breaks++;
+        }
+    }
+    int insert = breaks + !toend;
+    editorDelRows(r->at, torow - r->at + !toend);
+    erow* rows = editorInsertRows(r->at, insert);
+    for (int j = 0; j < insert; j++) {
+        char* end = memchr(p, '\n', total);
+        rows[j].chars = p;
+        rows[j].size = end ? end - p : (int) total;
+        if (end) {
+            total -= end + 1 - p;
+            p = end + 1;
+        }
+    }
+    editorInsertRowsDone(r->at, insert);
+
+    E.cy = redo ? r->ncy : r->cy;
+    E.cx = redo ? r->ncx : r->cx;
+}
+
+// Undo the last command's edits
+void editorUndo(void) {
+    struct undolog* u = &E.undo;
+    if (u->last == UNDO_NONE) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    struct undorec* r = undoRecord(u->last);
+    if (r == NULL) {
+        editorSetStatusMessage("Could not read undo history! Error: %s", strerror(errno));
+        return;
+    }
+    int group = r->group;
+    while (r && r->group == group) {
+        editorUndoApply(r, 0);
+        u->top = u->last;
+        u->last = r->prev;
+        r = u->last == UNDO_NONE ? NULL : undoRecord(u->last);
+    }
+}
+
+// Redo the edits of the last undone command
+void editorRedo(void) {
+    struct undolog* u = &E.undo;
+    if (u->top == u->len) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    struct undorec* r = undoRecord(u->top);
+    if (r == NULL) {
+        editorSetStatusMessage("Could not read undo history! Error: %s", strerror(errno));
+        return;
+    }
+    int group = r->group;
+    while (r && r->group == group) {
+        editorUndoApply(r, 1);
+        u->last = u->top;
+        u->top += undoRecordSize(r);
+        r = u->top == u->len ? NULL : undoRecord(u->top);
+    }
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
+    int grow = E.cy == E.numrows;
+    editorUndoBegin(E.cy, E.cx, E.cy, E.cx, UNDO_TYPE);
+    // Add new row to end of file when needed
+    if (grow) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    // Insert character and move cursor to right of character
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
+    // A new last row is inserted with the line break after it
+    editorUndoEnd(E.cy + grow, grow ? 0 : E.cx);
+}
+
+// Insert a new line (e.g. with Enter key)
+void editorInsertNewLine(void) {
+    // The edit inserts a line break at the cursor
+    editorUndoBegin(E.cy, E.cx, E.cy, E.cx, UNDO_EDIT);
+    // Insert new blank row before current line if at beginning of line
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    } else {
+        // Split the current line into two rows viewing the same text, unless
+        // the row owns it: then the new row takes its own copy of the rest
+        erow* row = editorRowAt(E.cy);
+        if (row->own) {
+            editorInsertRow(E.cy + 1, "", 0);
+            erow* next = editorRowAt(E.cy + 1);
+            row = editorRowAt(E.cy);
+            editorRowOwn(next, row->size - E.cx);
+            memcpy(next->own->data, &row->chars[E.cx], row->size - E.cx);
+            next->size = row->size - E.cx;
+        } else {
+            editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        }
+        // Update pointer to avoid invalidation
+        row = editorRowAt(E.cy);
+        row->size = E.cx;
+        editorUpdateRow(row);
+    }
+    E.cy++;
+    E.cx = 0;
+    editorUndoEnd(E.cy, E.cx);
+}
+
+// Insert text at the cursor as one edit, splitting it into rows at its
+// line breaks (\r, \n or \r\n)
+// The current row's text, the inserted text and the rest of the row are
+// copied once into the text storage and every affected row views that copy
+void editorInsertText(const char* s, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    int grow = E.cy == E.numrows;
+    editorUndoBegin(E.cy, E.cx, E.cy, E.cx, UNDO_EDIT);
+    // Add new row to end of file when needed
+    if (grow) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+
+    erow* row = editorRowAt(E.cy);
+    size_t suffix = row->size - E.cx;
+    size_t total = row->size + len;
+    char* p = textAlloc(total);
+    memcpy(p, row->chars, E.cx);
+    memcpy(&p[E.cx], s, len);
+    memcpy(&p[E.cx + len], &row->chars[E.cx], suffix);
+
+    // Count the line breaks, each of which starts a new row
+    int breaks = 0;
+    size_t j;
+    for (j = 0; j < len; j++) {
+        if (s[j] == '\n' || (s[j] == '\r' && (j + 1 == len || s[j + 1] != '\n'))) {
+            breaks++;
+        }
+    }
+
+    // Point the current row, then each new row, at its line of the copy
+    size_t linestart = 0;
+    size_t pos = E.cx;
+    erow* rows = editorInsertRows(E.cy + 1, breaks);
+    row = editorRowAt(E.cy);
+    for (int n = 0; n <= breaks; n++) {
+        erow* line = n == 0 ? row : &rows[n - 1];
+        size_t end = pos;
+        while (end < E.cx + len && p[end] != '\r' && p[end] != '\n') {
+            end++;
+        }
+        if (n == breaks) {
+            // The last line takes the rest of the original row
+            end = total;
+        }
+        if (n == 0) {
+            editorRowDisown(line);
+        }
+        line->chars = &p[linestart];
+        line->size = end - linestart;
+
+        // Skip the line break, counting \r\n as one
+        pos = end + 1;
+        if (end < total && p[end] == '\r' && pos < E.cx + len && p[pos] == '\n') {
+            pos++;
+        }
+        linestart = pos;
+    }
+    editorUpdateRow(row);
+    editorInsertRowsDone(E.cy + 1, breaks);
+
+    // Leave the cursor after the inserted text
+    E.cy += breaks;
+    E.cx = editorRowAt(E.cy)->size - suffix;
+    editorUndoEnd(E.cy + grow, grow ? 0 : E.cx);
+}
+
+// Read a bracketed paste up to its end marker and insert it as one edit
+void editorPaste(void) {
+    size_t cap = 4096;
+    size_t len = 0;
+    char* buf = malloc(cap);
+    if (buf == NULL) {
+        die("malloc");
+    }
+
+    while (1) {
+        // The paste may arrive over several reads
+        while (!editorInputPending()) {
+            editorWait();
+            editorFillInput();
+        }
+        char c;
+        editorReadByte(&c);
+
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (buf == NULL) {
+                die("realloc");
+            }
+        }
+        buf[len++] = c;
+        if (c == '~' && len >= 6 && memcmp(&buf[len - 6], "\x1b[201~", 6) == 0) {
+            len -= 6;
+            break;
+        }
+    }
+
+    editorInsertText(buf, len);
+    free(buf);
 }
 
-void editorDelRow(int at) {
-    // Check bounds
-    if (at < 0 || at >= E.numrows) {
-        return;
+// Delete a character
+void editorDelChar(void) {
+    // Return if cursor is beyond the last line
+    if (E.cy == E.numrows) {
+        return;
+    }
+    // Return if cursor is at the beginning of the first line
+    if (E.cx == 0 && E.cy == 0) {
+        return;
+    }
+
+    erow* row = editorRowAt(E.cy);
+    if (E.cx > 0) {
+        editorUndoBegin(E.cy, E.cx - 1, E.cy, E.cx, UNDO_DELETE);
+        editorRowDelChar(row, E.cx - 1);
+        E.cx--;
+    } else {
+        // Handle case where cursor is at beginning of line
+        // The edit removes the line break before the current row
+        erow* prev = editorRowAt(E.cy - 1);
+        editorUndoBegin(E.cy - 1, prev->size, E.cy, 0, UNDO_EDIT);
+        row = editorRowAt(E.cy);
+        prev = editorRowAt(E.cy - 1);
+        E.cx = prev->size;
+        editorRowAppendString(prev, row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+    editorUndoEnd(E.cy, E.cx);
+}
+
+/*** line index ***/
+
+// Start offsets of the lines in a buffer, found in a single pass
+struct lineindex {
+    size_t* start;          // Offset of each line, plus one past the end of the last line's terminator
+    unsigned char* cr;      // Whether each line ends in '\r' before its terminator
+    int numlines;           // Number of lines
+    int cap;                // Number of lines allocated
+};
+
+// Record a line terminator at an offset
+static inline void lineIndexPush(struct lineindex* li, size_t next, int cr) {
+    if (li->numlines + 1 >= li->cap) {
+        li->cap *= 2;
+        li->start = realloc(li->start, sizeof(size_t) * li->cap);
+        li->cr = realloc(li->cr, li->cap);
+        if (li->start == NULL || li->cr == NULL) {
+            die("realloc");
+        }
+    }
+    li->cr[li->numlines] = cr;
+    li->start[++li->numlines] = next;
+}
+
+#ifdef KILO_X86
+// Find newlines 32 bytes at a time, taking '\r' flags from the same loads
+// Return the offset where the scalar tail has to continue
+__attribute__((target("avx2")))
+static size_t lineIndexScanAVX2(const char* buf, size_t len, struct lineindex* li) {
+    const __m256i nlv = _mm256_set1_epi8('\n');
+    const __m256i crv = _mm256_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) &buf[i]);
+        uint32_t nl = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nlv));
+        if (nl == 0) {
+            continue;
+        }
+        // Bit b of crbefore is set when the byte before buf[i + b] is '\r'
+        uint32_t cr = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, crv));
+        uint32_t crbefore = (cr << 1) | (i > 0 && buf[i - 1] == '\r');
+        while (nl) {
+            int b = __builtin_ctz(nl);
+            lineIndexPush(li, i + b + 1, (crbefore >> b) & 1);
+            nl &= nl - 1;
+        }
+    }
+    return i;
+}
+
+// Find newlines 16 bytes at a time (SSE2 is always available on x86-64)
+static size_t lineIndexScanSSE2(const char* buf, size_t len, struct lineindex* li) {
+    const __m128i nlv = _mm_set1_epi8('\n');
+    const __m128i crv = _mm_set1_epi8('\r');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) &buf[i]);
+        uint32_t nl = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nlv));
+        if (nl == 0) {
+            continue;
+        }
+        uint32_t cr = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, crv));
+        uint32_t crbefore = (cr << 1) | (i > 0 && buf[i - 1] == '\r');
+        while (nl) {
+            int b = __builtin_ctz(nl);
+            lineIndexPush(li, i + b + 1, (crbefore >> b) & 1);
+            nl &= nl - 1;
+        }
+    }
+    return i;
+}
+#endif
+
+// Index the lines of a buffer, splitting it on '\n'
+// A final line without a terminator ends at a virtual terminator at len
+void lineIndexBuild(const char* buf, size_t len, struct lineindex* li) {
+    li->cap = 1024;
+    li->numlines = 0;
+    li->start = malloc(sizeof(size_t) * li->cap);
+    li->cr = malloc(li->cap);
+    if (li->start == NULL || li->cr == NULL) {
+        die("malloc");
+    }
+    li->start[0] = 0;
+
+    size_t i = 0;
+#ifdef KILO_X86
+    if (__builtin_cpu_supports("avx2")) {
+        i = lineIndexScanAVX2(buf, len, li);
+    } else {
+        i = lineIndexScanSSE2(buf, len, li);
+    }
+#endif
+    // Scalar fallback, and the tail left over by the vector loops
+    for (; i < len; i++) {
+        if (buf[i] == '\n') {
+            lineIndexPush(li, i + 1, i > 0 && buf[i - 1] == '\r');
+        }
+    }
+
+    if (li->start[li->numlines] < len) {
+        lineIndexPush(li, len + 1, buf[len - 1] == '\r');
+    }
+}
+
+void lineIndexFree(struct lineindex* li) {
+    free(li->start);
+    free(li->cr);
+}
+
+/*** file i/o ***/
+
+// Open a file
+void editorOpen(char *filename) {
+    // Get filename to display in status bar
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    // Open specified file, or exit on failure
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        die("open");
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        die("fstat");
+    }
+
+    // Map regular files as the original buffer of the piece table,
+    // and read anything else (pipes, devices) into memory
+    textFree();
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        E.text.orig = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (E.text.orig == MAP_FAILED) {
+            die("mmap");
+        }
+        E.text.origlen = st.st_size;
+        E.text.orig_mapped = 1;
+    } else if (!S_ISREG(st.st_mode)) {
+        size_t cap = 0;
+        ssize_t nread;
+        do {
+            if (E.text.origlen == cap) {
+                cap = cap ? cap * 2 : KILO_ADD_BLOCK;
+                E.text.orig = realloc(E.text.orig, cap);
+                if (E.text.orig == NULL) {
+                    die("realloc");
+                }
+            }
+            nread = read(fd, &E.text.orig[E.text.origlen], cap - E.text.origlen);
+            if (nread == -1) {
+                die("read");
+            }
+            E.text.origlen += nread;
+        } while (nread > 0);
+    }
+    close(fd);
+
+    // Index the lines of the original buffer, then point a row at each line
+    struct lineindex li;
+    lineIndexBuild(E.text.orig, E.text.origlen, &li);
+    int at = E.numrows;
+    erow* rows = editorInsertRows(at, li.numlines);
+    for (int j = 0; j < li.numlines; j++) {
+        const char* line = &E.text.orig[li.start[j]];
+        size_t linelen = li.start[j + 1] - li.start[j] - 1;
+        if (li.cr[j]) {
+            while (linelen > 0 && line[linelen - 1] == '\r') {
+                linelen--;
+            }
+        }
+
+        rows[j].size = linelen;
+        rows[j].chars = line;
+    }
+    editorInsertRowsDone(at, li.numlines);
+    lineIndexFree(&li);
+    editorUndoLoad(&st);
+
+    E.dirty = 0;
+}
+
+// Point every row into a mapping of the file just saved (len bytes at buf,
+// or NULL if empty), which becomes the new original buffer
+// Text no row views any more (older versions and the add buffer) is freed
+void editorRebaseRows(char* buf, size_t len) {
+    textFreeLater();
+    E.text.orig = buf;
+    E.text.origlen = len;
+    E.text.orig_mapped = buf != NULL;
+
+    char* p = buf;
+    for (int j = 0; j < E.numrows; j++) {
+        erow* row = editorRowAt(j);
+        editorRowDisown(row);
+        row->chars = p;
+        p += row->size + 1;
+    }
+}
+
+// Copy the original buffer into memory and point the rows viewing it at the
+// copy, so that the file it was mapped from can be overwritten in place
+void editorCopyOriginal(void) {
+    if (!E.text.orig_mapped) {
+        return;
+    }
+    char* orig = E.text.orig;
+    char* copy = malloc(E.text.origlen);
+    if (copy == NULL) {
+        die("malloc");
+    }
+    memcpy(copy, orig, E.text.origlen);
+    for (int j = 0; j < E.numrows; j++) {
+        erow* row = editorRowAt(j);
+        if (row->chars >= orig && row->chars < orig + E.text.origlen) {
+            row->chars = copy + (row->chars - orig);
+        }
+    }
+    munmap(orig, E.text.origlen);
+    E.text.orig = copy;
+    E.text.orig_mapped = 0;
+}
+
+// Add len bytes at p to n pieces to write, extending the last piece when p
+// follows on from it in memory and it is under KILO_WRITE_CHUNK
+// Return the new number of pieces
+int iovAppend(struct iovec* iov, int n, const char* p, size_t len) {
+    if (len == 0) {
+        return n;
+    }
+    if (n > 0 && (const char*) iov[n - 1].iov_base + iov[n - 1].iov_len == p &&
+        iov[n - 1].iov_len + len <= KILO_WRITE_CHUNK) {
+        iov[n - 1].iov_len += len;
+        return n;
+    }
+    iov[n].iov_base = (void*) p;
+    iov[n].iov_len = len;
+    return n + 1;
+}
+
+// Write a batch of n pieces in full, resuming after short writes
+// Return 0 on success, or -1 with errno set
+int iovWrite(int fd, struct iovec* iov, int n) {
+    while (n > 0) {
+        ssize_t done = writev(fd, iov, n);
+        if (done == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // Skip the pieces written in full and trim the next one
+        while (n > 0 && (size_t) done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+// Snapshot the document into a save job as the pieces of text to write:
+// every row and a '\n' after it, pointing straight at the rows' text
+// A row still lying in the original buffer is taken together with the '\n'
+// that follows it there, and pieces that follow on in memory are merged, so
+// an unedited stretch of the file becomes a few long pieces
+void editorSnapshotRows(struct savejob* job) {
+    const char* orig = E.text.orig;
+    job->numiov = 0;
+    job->len = 0;
+    for (int j = 0; j < E.numrows; j++) {
+        // Each row adds at most two pieces
+        if (job->numiov + 2 > job->cap) {
+            job->cap = job->cap ? job->cap * 2 : KILO_WRITE_IOV;
+            job->iov = realloc(job->iov, sizeof(struct iovec) * job->cap);
+            if (job->iov == NULL) {
+                die("realloc");
+            }
+        }
+        erow* row = editorRowAt(j);
+        // The writer thread reads the row while it may be edited again, so
+        // a block the row owns becomes part of the add buffer
+        if (row->own) {
+            textAdopt(row->own);
+            row->own = NULL;
+        }
+        const char* end = row->chars + row->size;
+        int newline = orig && end >= orig && end < orig + E.text.origlen && *end == '\n';
+        job->numiov = iovAppend(job->iov, job->numiov, row->chars, row->size + newline);
+        if (!newline) {
+            job->numiov = iovAppend(job->iov, job->numiov, "\n", 1);
+        }
+        job->len += row->size + 1;
+    }
+}
+
+// Write the pieces of a save job to a file with writev, in batches of up
+// to KILO_WRITE_IOV pieces or KILO_WRITE_CHUNK bytes, counting the bytes
+// written after each batch
+// Return 0 on success, or -1 with errno set
+int editorWritePieces(int fd, struct savejob* job) {
+    int j = 0;
+    while (j < job->numiov) {
+        int n = 0;
+        size_t bytes = 0;
+        while (j + n < job->numiov && n < KILO_WRITE_IOV && bytes < KILO_WRITE_CHUNK) {
+            bytes += job->iov[j + n].iov_len;
+            n++;
+        }
+        if (iovWrite(fd, &job->iov[j], n) == -1) {
+            return -1;
+        }
+        j += n;
+
+        pthread_mutex_lock(&job->lock);
+        job->written += bytes;
+        pthread_mutex_unlock(&job->lock);
+    }
+    return 0;
+}
+
+// Open the file a save job writes: a temporary file in the same directory,
+// to be renamed over the file once written and flushed to disk, so a
+// partly written file is never left behind
+// An existing file keeps its mode and owner, and a symlink is followed so
+// the file it points to is replaced rather than the link
+// If the directory does not let us create files (but the file may be
+// writable), the file is written in place instead. That keeps its inode, and
+// so its hard links and extended attributes, which the rename replaces, but
+// a crash while writing can leave it partly written
+// Return 0 on success, or -1 with errno set
+int editorSaveOpen(struct savejob* job) {
+    job->target = realpath(job->filename, NULL);
+    if (job->target == NULL) {
+        job->target = strdup(job->filename);
+    }
+    char* slash = strrchr(job->target, '/');
+    int dirlen = slash ? slash - job->target : 0;
+    const char* base = slash ? slash + 1 : job->target;
+
+    size_t size = strlen(job->target) + 10;
+    job->tmp = malloc(size);
+    if (job->tmp == NULL) {
+        die("malloc");
+    }
+    snprintf(job->tmp, size, "%.*s%s.%s.XXXXXX", dirlen, job->target, slash ? "/" : "", base);
+
+    job->fd = mkstemp(job->tmp);
+    if (job->fd == -1 && errno != EACCES && errno != EPERM) {
+        return -1;
+    }
+    if (job->fd == -1) {
+        free(job->tmp);
+        job->tmp = NULL;
+        // Reading the file back lets the rows view it once it is written
+        job->fd = open(job->target, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (job->fd == -1) {
+            job->fd = open(job->target, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        }
+        return job->fd == -1 ? -1 : 0;
+    }
+
+    // New files get the usual mode, less the umask
+    struct stat st;
+    if (stat(job->target, &st) == 0) {
+        if (fchown(job->fd, st.st_uid, st.st_gid) == -1) {
+            // Only root can give the file away; keep the group if possible
+            fchown(job->fd, -1, st.st_gid);
+        }
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        st.st_mode = 0644 & ~mask;
+    }
+    if (fchmod(job->fd, st.st_mode & 07777) == -1) {
+        int saved = errno;
+        close(job->fd);
+        unlink(job->tmp);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// Write a save job's pieces to the file editorSaveOpen() opened and flush
+// it, then rename a temporary file over the file
+// The new file is mapped into the job's map (NULL if it is empty or cannot
+// be mapped)
+// Runs on the writer thread, so it only touches the job
+// Return 0 on success, or -1 with errno set
+int editorWriteFile(struct savejob* job) {
+    int fd = job->fd;
+    int ok = job->tmp || ftruncate(fd, 0) == 0;
+    ok = ok && editorWritePieces(fd, job) == 0;
+    ok = ok && fsync(fd) == 0;
+    ok = ok && fstat(fd, &job->st) == 0;
+    job->map = NULL;
+    if (ok && job->len > 0) {
+        job->map = mmap(NULL, job->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (job->map == MAP_FAILED) {
+            job->map = NULL;
+        }
+    }
+    // The undo history is keyed on the contents it was saved with, which
+    // are the pieces written whether or not the file could be mapped
+    struct hasher hs;
+    hashInit(&hs, job->len);
+    for (int j = 0; j < job->numiov; j++) {
+        hashAdd(&hs, job->iov[j].iov_base, job->iov[j].iov_len);
+    }
+    job->hash = hashEnd(&hs);
+    ok = close(fd) == 0 && ok;
+    if (job->tmp == NULL) {
+        return ok ? 0 : -1;
+    }
+    ok = ok && rename(job->tmp, job->target) == 0;
+
+    if (ok) {
+        // Make the rename itself durable
+        char* slash = strrchr(job->target, '/');
+        char dir[PATH_MAX] = ".";
+        if (slash) {
+            int dirlen = slash - job->target;
+            snprintf(dir, sizeof(dir), "%.*s", dirlen ? dirlen : 1, job->target);
+        }
+        int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dirfd != -1) {
+            fsync(dirfd);
+            close(dirfd);
+        }
+    } else {
+        int saved = errno;
+        if (job->map) {
+            munmap(job->map, job->len);
+            job->map = NULL;
+        }
+        unlink(job->tmp);
+        errno = saved;
+    }
+    return ok ? 0 : -1;
+}
+
+// Write the save job on the writer thread, then wake the main thread
+void* editorSaveThread(void* arg) {
+    struct savejob* job = arg;
+    job->err = 0;
+    if (editorWriteFile(job) == -1) {
+        job->err = errno ? errno : EIO;
+    }
+    pthread_mutex_lock(&job->lock);
+    job->finished = 1;
+    pthread_mutex_unlock(&job->lock);
+    write(E.sigpipe[1], "s", 1);
+    return NULL;
+}
+
+// Remove the temporary file of a save still running when the program exits
+// The writer thread's rename then fails, leaving the file untouched
+void editorSaveAbort(void) {
+    if (E.save.running && E.save.tmp) {
+        unlink(E.save.tmp);
+    }
+}
+
+// Free what a save job allocated
+void editorSaveFree(struct savejob* job) {
+    free(job->filename);
+    job->filename = NULL;
+    free(job->target);
+    job->target = NULL;
+    free(job->tmp);
+    job->tmp = NULL;
+    free(job->iov);
+    job->iov = NULL;
+    job->cap = 0;
+}
+
+// Whether the writer thread of the save in progress is done
+int editorSaveFinished(void) {
+    struct savejob* job = &E.save;
+    if (!job->running) {
+        return 0;
+    }
+    pthread_mutex_lock(&job->lock);
+    int finished = job->finished;
+    pthread_mutex_unlock(&job->lock);
+    return finished;
+}
+
+// Show how far the save in progress has got, unless a prompt is on the
+// message bar
+void editorSaveProgress(void) {
+    struct savejob* job = &E.save;
+    if (!job->running) {
+        return;
+    }
+    editorSetTimer(TIMER_SAVE, KILO_SAVE_PROGRESS, editorSaveProgress);
+    if (E.prompting) {
+        return;
+    }
+    pthread_mutex_lock(&job->lock);
+    size_t written = job->written;
+    pthread_mutex_unlock(&job->lock);
+
+    editorSetStatusMessage("Saving: %zu of %zu bytes (%d%%)", written, job->len,
+        job->len ? (int) (written * 100 / job->len) : 100);
+    editorRefreshScreen();
+}
+
+// Finish the save in progress, waiting for the writer thread if needed
+// If nothing was edited since the snapshot, the rows view the new file from
+// now on; otherwise (or if it could not be mapped) they keep viewing the
+// old text, which stays valid after the rename
+void editorSaveDone(void) {
+    struct savejob* job = &E.save;
+    if (!job->running) {
+        return;
+    }
+    pthread_join(job->thread, NULL);
+    job->running = 0;
+    E.timers[TIMER_SAVE].fn = NULL;
+    int inplace = job->tmp == NULL;
+    editorSaveFree(job);
+
+    if (job->err) {
+        // The file on disk is untouched, unless it was written in place
+        editorSetStatusMessage("Could not save file! Error: %s", strerror(job->err));
+        return;
+    }
+    if (E.dirty == job->dirty) {
+        editorUndoSync(job->hash, &job->st);
+        // Rows that cannot view the new file stay on the text they viewed
+        if (job->map || job->len == 0) {
+            editorRebaseRows(job->map, job->len);
+        }
+        E.dirty = 0;
+    } else if (job->map) {
+        munmap(job->map, job->len);
+    }
+    if (inplace) {
+        editorSetStatusMessage("%zu bytes written in place in %lld ms (directory not writable)",
+            job->len, editorNow() - job->start);
+    } else {
+        editorSetStatusMessage("%zu bytes written to disk in %lld ms", job->len, editorNow() - job->start);
+    }
+}
+
+// Save text to a file
+// The document is snapshotted and written on a writer thread, so editing
+// carries on while it is saved
+void editorSave(void) {
+    struct savejob* job = &E.save;
+    if (job->running) {
+        editorSetStatusMessage("Save in progress");
+        return;
+    }
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    job->start = editorNow();
+    job->filename = strdup(E.filename);
+    job->dirty = E.dirty;
+    job->written = 0;
+    job->finished = 0;
+    if (editorSaveOpen(job) == -1) {
+        editorSetStatusMessage("Could not save file! Error: %s", strerror(errno));
+        editorSaveFree(job);
+        return;
+    }
+    // Nothing may view the file while it is overwritten
+    if (job->tmp == NULL) {
+        editorCopyOriginal();
+    }
+    editorSnapshotRows(job);
+
+    errno = pthread_create(&job->thread, NULL, editorSaveThread, job);
+    if (errno) {
+        editorSetStatusMessage("Could not save file! Error: %s", strerror(errno));
+        close(job->fd);
+        if (job->tmp) {
+            unlink(job->tmp);
+        }
+        editorSaveFree(job);
+        return;
+    }
+    job->running = 1;
+    editorSaveProgress();
+}
+
+/*** search ***/
+
+#ifdef KILO_X86
+// Find a needle of two or more bytes 32 positions at a time: a position is
+// only compared in full when both its first and its last byte match
+// Return the match, or the offset where the scalar tail has to continue
+__attribute__((target("avx2")))
+static const char* searchScanAVX2(const char* hay, size_t len, const char* needle, size_t n, size_t* tail) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[n - 1]);
+    size_t i = 0;
+    for (; i + n - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) &hay[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*) &hay[i + n - 1]);
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(&hay[i + bit + 1], &needle[1], n - 2) == 0) {
+                return &hay[i + bit];
+            }
+            mask &= mask - 1;
+        }
+    }
+    *tail = i;
+    return NULL;
+}
+
+// Same filter 16 positions at a time (SSE2 is always available on x86-64)
+static const char* searchScanSSE2(const char* hay, size_t len, const char* needle, size_t n, size_t* tail) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    size_t i = 0;
+    for (; i + n - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) &hay[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*) &hay[i + n - 1]);
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(&hay[i + bit + 1], &needle[1], n - 2) == 0) {
+                return &hay[i + bit];
+            }
+            mask &= mask - 1;
+        }
+    }
+    *tail = i;
+    return NULL;
+}
+#endif
+
+// Return the first occurrence of n bytes of needle in len bytes of hay, or NULL
+// Either may contain NUL bytes
+const char* searchMemory(const char* hay, size_t len, const char* needle, size_t n) {
+    if (n == 0) {
+        return hay;
+    }
+    if (n > len) {
+        return NULL;
+    }
+    if (n == 1) {
+        return memchr(hay, needle[0], len);
+    }
+
+    size_t i = 0;
+#ifdef KILO_X86
+    const char* match;
+    if (__builtin_cpu_supports("avx2")) {
+        match = searchScanAVX2(hay, len, needle, n, &i);
+    } else {
+        match = searchScanSSE2(hay, len, needle, n, &i);
+    }
+    if (match) {
+        return match;
+    }
+#endif
+    // Scalar fallback, and the tail left over by the vector loops
+    while (i + n <= len) {
+        const char* p = memchr(&hay[i], needle[0], len - n + 1 - i);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (memcmp(p + 1, &needle[1], n - 1) == 0) {
+            return p;
+        }
+        i = p - hay + 1;
+    }
+    return NULL;
+}
+
+// Return whether row b directly follows row a in the original buffer with
+// only a line terminator between them, so both can be searched as one block
+int editorRowsAdjacent(erow* a, erow* b) {
+    const char* orig = E.text.orig;
+    const char* end = a->chars + a->size;
+    if (orig == NULL || a->chars < orig || b->chars > orig + E.text.origlen || b->chars <= end || b->chars - end > 8) {
+        return 0;
+    }
+    for (const char* p = end; p < b->chars; p++) {
+        if (*p != '\r' && *p != '\n') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Find the first row in [from, to) containing a query, and the match's
+// column in that row's characters
+// Rows lying back to back in memory are searched as one block, so an
+// unedited file is scanned in a few long passes; blocks start at one row and
+// double while nothing matches, so dense matches are not paid for with long
+// blocks
+// Return the row, or -1 if there is no match
+int editorSearchRows(int from, int to, const char* query, size_t qlen, int* col) {
+    int j = from;
+    int limit = 1;
+    while (j < to) {
+        // Extend the block over the rows that follow on in memory
+        int k = j + 1;
+        while (k < to && k - j < limit && editorRowsAdjacent(editorRowAt(k - 1), editorRowAt(k))) {
+            k++;
+        }
+        if (limit < INT_MAX / 2) {
+            limit *= 2;
+        }
+        erow* first = editorRowAt(j);
+        erow* last = editorRowAt(k - 1);
+        const char* start = first->chars;
+        const char* end = last->chars + last->size;
+
+        const char* p = start;
+        const char* match;
+        while ((match = searchMemory(p, end - p, query, qlen)) != NULL) {
+            // Find the row holding the match by bisecting the block
+            int lo = j, hi = k - 1;
+            while (lo < hi) {
+                int mid = lo + (hi - lo + 1) / 2;
+                if (editorRowAt(mid)->chars <= match) {
+                    lo = mid;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            // Skip matches that run into a line terminator
+            erow* row = editorRowAt(lo);
+            if (match + qlen <= row->chars + row->size) {
+                *col = match - row->chars;
+                return lo;
+            }
+            p = match + 1;
+        }
+        j = k;
+    }
+    return -1;
+}
+
+/*** regex ***/
+
+// Add a node to a regex and return its index
+int reNode(struct regex* re, int op) {
+    if (re->numnodes == re->cap) {
+        re->cap = re->cap ? re->cap * 2 : 32;
+        re->nodes = realloc(re->nodes, sizeof(struct reNode) * re->cap);
+        if (re->nodes == NULL) {
+            die("realloc");
+        }
+    }
+    struct reNode* node = &re->nodes[re->numnodes];
+    node->op = op;
+    node->out = -1;
+    node->out1 = -1;
+    memset(node->cls, 0, sizeof(node->cls));
+    return re->numnodes++;
+}
+
+// Return a fragment of a single node, leaving its exit dangling
+struct reFrag reFragment(struct regex* re, int op) {
+    struct reFrag f;
+    f.start = reNode(re, op);
+    f.end = reNode(re, RE_JMP);
+    re->nodes[f.start].out = f.end;
+    return f;
+}
+
+// Add a byte, or a range of bytes, to a class
+void reClassAdd(uint32_t* cls, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) {
+        cls[c >> 5] |= 1u << (c & 31);
+    }
+}
+
+// Add the bytes of a class escape such as \d, or of its negation \D, to a
+// class
+// Return 1 if the escape was one, 0 if it stands for the byte itself, or -1
+// if it is a letter with no meaning
+int reClassEscape(uint32_t* cls, char c) {
+    uint32_t bytes[8];
+    memset(bytes, 0, sizeof(bytes));
+    switch (tolower((unsigned char)c)) {
+        case 'd': reClassAdd(bytes, '0', '9'); break;
+        case 'w': reClassAdd(bytes, '0', '9'); reClassAdd(bytes, 'a', 'z');
+                  reClassAdd(bytes, 'A', 'Z'); reClassAdd(bytes, '_', '_'); break;
+        case 's': reClassAdd(bytes, ' ', ' '); reClassAdd(bytes, '\t', '\r'); break;
+        default: return isalpha((unsigned char)c) ? -1 : 0;
+    }
+    int negate = isupper((unsigned char)c);
+    for (int j = 0; j < 8; j++) {
+        cls[j] |= negate ? ~bytes[j] : bytes[j];
+    }
+    return 1;
+}
+
+struct reFrag reParseAlt(struct regex* re, const char** p);
+
+// Parse a bracketed class, with *p just after the '['
+struct reFrag reParseClass(struct regex* re, const char** p) {
+    struct reFrag f = reFragment(re, RE_CLASS);
+    uint32_t* cls = re->nodes[f.start].cls;
+    int negate = 0;
+    if (**p == '^') {
+        negate = 1;
+        (*p)++;
+    }
+    // A ']' right after the '[' (or "[^") is a literal
+    int first = 1;
+    while (**p && (**p != ']' || first)) {
+        first = 0;
+        int lo = (unsigned char)*(*p)++;
+        if (lo == '\\' && **p) {
+            int escape = reClassEscape(cls, **p);
+            if (escape == -1) {
+                re->error = 1;
+                return f;
+            }
+            if (escape) {
+                (*p)++;
+                continue;
+            }
+            lo = (unsigned char)*(*p)++;
+        }
+        int hi = lo;
+        if ((*p)[0] == '-' && (*p)[1] && (*p)[1] != ']') {
+            hi = (unsigned char)(*p)[1];
+            *p += 2;
+        }
+        if (lo <= hi) {
+            reClassAdd(cls, lo, hi);
+        }
+    }
+    if (**p != ']') {
+        re->error = 1;
+        return f;
+    }
+    (*p)++;
+    if (negate) {
+        for (int j = 0; j < 8; j++) {
+            cls[j] = ~cls[j];
+        }
+    }
+    return f;
+}
+
+// Parse a single item: a byte, a class, an anchor or a group
+struct reFrag reParseAtom(struct regex* re, const char** p) {
+    struct reFrag f;
+    char c = *(*p)++;
+    switch (c) {
+        case '(': {
+            f = reParseAlt(re, p);
+            if (**p != ')') {
+                re->error = 1;
+                return f;
+            }
+            (*p)++;
+            return f;
+        }
+        case '[': {
+            return reParseClass(re, p);
+        }
+        case '.': {
+            f = reFragment(re, RE_CLASS);
+            reClassAdd(re->nodes[f.start].cls, 0, 255);
+            return f;
+        }
+        case '^': {
+            return reFragment(re, RE_BOL);
+        }
+        case '$': {
+            return reFragment(re, RE_EOL);
+        }
+        case '\\': {
+            if (**p == '\0') {
+                re->error = 1;
+                return reFragment(re, RE_JMP);
+            }
+            c = *(*p)++;
+            f = reFragment(re, RE_CLASS);
+            int escape = reClassEscape(re->nodes[f.start].cls, c);
+            if (escape == -1) {
+                re->error = 1;
+            } else if (escape == 0) {
+                reClassAdd(re->nodes[f.start].cls, (unsigned char)c, (unsigned char)c);
+            }
+            return f;
+        }
+    }
+    f = reFragment(re, RE_CLASS);
+    reClassAdd(re->nodes[f.start].cls, (unsigned char)c, (unsigned char)c);
+    return f;
+}
+
+// Parse an item followed by any number of '*', '+' and '?'
+struct reFrag reParseRepeat(struct regex* re, const char** p) {
+    struct reFrag f = reParseAtom(re, p);
+    while (**p == '*' || **p == '+' || **p == '?') {
+        char op = *(*p)++;
+        int split = reNode(re, RE_SPLIT);
+        int end = reNode(re, RE_JMP);
+        re->nodes[split].out = f.start;
+        re->nodes[split].out1 = end;
+        // '*' and '+' loop back through the split; '?' only skips
+        re->nodes[f.end].out = (op == '?') ? end : split;
+        f.start = (op == '+') ? f.start : split;
+        f.end = end;
+    }
+    return f;
+}
+
+// Parse a sequence of items, up to a '|' or ')' or the end
+struct reFrag reParseConcat(struct regex* re, const char** p) {
+    struct reFrag f = reFragment(re, RE_JMP);
+    while (**p && **p != '|' && **p != ')' && !re->error) {
+        if (**p == '*' || **p == '+' || **p == '?') {
+            re->error = 1;
+            break;
+        }
+        struct reFrag next = reParseRepeat(re, p);
+        re->nodes[f.end].out = next.start;
+        f.end = next.end;
+    }
+    return f;
+}
+
+// Parse alternatives separated by '|'
+struct reFrag reParseAlt(struct regex* re, const char** p) {
+    struct reFrag f = reParseConcat(re, p);
+    while (**p == '|' && !re->error) {
+        (*p)++;
+        struct reFrag alt = reParseConcat(re, p);
+        int split = reNode(re, RE_SPLIT);
+        int end = reNode(re, RE_JMP);
+        re->nodes[split].out = f.start;
+        re->nodes[split].out1 = alt.start;
+        re->nodes[f.end].out = end;
+        re->nodes[alt.end].out = end;
+        f.start = split;
+        f.end = end;
+    }
+    return f;
+}
+
+// Drop every state of a DFA, keeping its allocations
+void dfaFlush(struct dfa* d) {
+    for (int j = 0; j < d->numstates; j++) {
+        free(d->states[j]);
+    }
+    d->numstates = 0;
+    for (int j = 0; j < KILO_DFA_TABLE; j++) {
+        d->table[j] = -1;
+    }
+    d->start[0] = -1;
+    d->start[1] = -1;
+}
+
+void dfaInit(struct dfa* d, int anchored) {
+    d->anchored = anchored;
+    d->numstates = 0;
+    d->states = malloc(sizeof(struct dfaState*) * KILO_DFA_STATES);
+    d->table = malloc(sizeof(int) * KILO_DFA_TABLE);
+    if (d->states == NULL || d->table == NULL) {
+        die("malloc");
+    }
+    dfaFlush(d);
+}
+
+// Compile a regular expression
+// Supports literals, '.', classes ("[a-z]", "[^0-9]", \d \w \s and their
+// negations \D \W \S), anchors ('^' and '$' at the ends of a row), grouping,
+// '|', '*', '+' and '?'
+// Return NULL if the pattern is malformed
+struct regex* reCompile(const char* pattern) {
+    struct regex* re = malloc(sizeof(struct regex));
+    if (re == NULL) {
+        die("malloc");
+    }
+    re->nodes = NULL;
+    re->numnodes = 0;
+    re->cap = 0;
+    re->error = 0;
+
+    const char* p = pattern;
+    struct reFrag f = reParseAlt(re, &p);
+    if (*p != '\0') {
+        re->error = 1;
+    }
+    int match = reNode(re, RE_MATCH);
+    re->nodes[f.end].out = match;
+    re->start = f.start;
+    if (re->error) {
+        free(re->nodes);
+        free(re);
+        return NULL;
+    }
+
+    re->set = malloc(sizeof(int) * re->numnodes);
+    re->stack = malloc(sizeof(int) * (re->numnodes * 2 + 1));
+    re->mark = calloc(re->numnodes, sizeof(int));
+    if (re->set == NULL || re->stack == NULL || re->mark == NULL) {
+        die("malloc");
+    }
+    for (int j = 0; j < 2; j++) {
+        re->threads[j] = malloc(sizeof(int) * re->numnodes);
+        re->starts[j] = malloc(sizeof(int) * re->numnodes);
+        if (re->threads[j] == NULL || re->starts[j] == NULL) {
+            die("malloc");
+        }
+    }
+    re->markgen = 0;
+    dfaInit(&re->fwd, 0);
+    dfaInit(&re->anchored, 1);
+    return re;
+}
+
+void reFree(struct regex* re) {
+    if (re == NULL) {
+        return;
+    }
+    struct dfa* dfas[] = {&re->fwd, &re->anchored};
+    for (int j = 0; j < 2; j++) {
+        dfaFlush(dfas[j]);
+        free(dfas[j]->states);
+        free(dfas[j]->table);
+    }
+    free(re->nodes);
+    free(re->set);
+    free(re->stack);
+    free(re->mark);
+    for (int j = 0; j < 2; j++) {
+        free(re->threads[j]);
+        free(re->starts[j]);
+    }
+    free(re);
+}
+
+// Add a node and every node reachable from it without consuming a byte to
+// the set being built in set (re->mark holds the current generation for
+// nodes already in it)
+// Only the nodes a DFA state is made of are kept: classes, anchors at the
+// end of a row and the match node
+void reClosure(struct regex* re, int node, int bol, int eol, int* set, int* n) {
+    int sp = 0;
+    re->stack[sp++] = node;
+    while (sp > 0) {
+        int id = re->stack[--sp];
+        if (id < 0 || re->mark[id] == re->markgen) {
+            continue;
+        }
+        re->mark[id] = re->markgen;
+        struct reNode* nd = &re->nodes[id];
+        switch (nd->op) {
+            case RE_SPLIT:
+                re->stack[sp++] = nd->out1;
+                re->stack[sp++] = nd->out;
+                break;
+            case RE_JMP:
+                re->stack[sp++] = nd->out;
+                break;
+            case RE_BOL:
+                if (bol) {
+                    re->stack[sp++] = nd->out;
+                }
+                break;
+            case RE_EOL:
+                if (eol) {
+                    re->stack[sp++] = nd->out;
+                } else {
+                    set[(*n)++] = id;
+                }
+                break;
+            default:
+                set[(*n)++] = id;
+                break;
+        }
+    }
+}
+
+int reCompareInt(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+// Return the state of a DFA for the node set in re->set, adding it if new
+// Adding to a full DFA flushes it first, so other state indexes are invalid
+// afterwards; *flushed tells the caller
+int dfaState(struct regex* re, struct dfa* d, int n, int* flushed) {
+    qsort(re->set, n, sizeof(int), reCompareInt);
+    unsigned int h = 2166136261u;
+    for (int j = 0; j < n; j++) {
+        h = (h ^ (unsigned int)re->set[j]) * 16777619u;
+    }
+
+    unsigned int slot = h & (KILO_DFA_TABLE - 1);
+    while (d->table[slot] != -1) {
+        struct dfaState* s = d->states[d->table[slot]];
+        if (s->n == n && memcmp(s->set, re->set, sizeof(int) * n) == 0) {
+            return d->table[slot];
+        }
+        slot = (slot + 1) & (KILO_DFA_TABLE - 1);
+    }
+
+    if (d->numstates == KILO_DFA_STATES) {
+        dfaFlush(d);
+        *flushed = 1;
+        slot = h & (KILO_DFA_TABLE - 1);
+    }
+
+    struct dfaState* s = malloc(sizeof(struct dfaState) + sizeof(int) * n);
+    if (s == NULL) {
+        die("malloc");
+    }
+    s->n = n;
+    memcpy(s->set, re->set, sizeof(int) * n);
+    for (int c = 0; c < 256; c++) {
+        s->next[c] = -1;
+    }
+    s->accept = 0;
+    s->accepteol = 0;
+    for (int j = 0; j < n; j++) {
+        if (re->nodes[s->set[j]].op == RE_MATCH) {
+            s->accept = 1;
+        }
+    }
+
+    // Whether passing the '$' anchors in the set reaches the match node
+    re->markgen++;
+    int m = 0;
+    for (int j = 0; j < n; j++) {
+        if (re->nodes[s->set[j]].op == RE_EOL) {
+            reClosure(re, re->nodes[s->set[j]].out, 0, 1, re->set, &m);
+        }
+    }
+    for (int j = 0; j < m; j++) {
+        if (re->nodes[re->set[j]].op == RE_MATCH) {
+            s->accepteol = 1;
+        }
+    }
+    s->accepteol |= s->accept;
+
+    d->states[d->numstates] = s;
+    d->table[slot] = d->numstates;
+    return d->numstates++;
+}
+
+// Return the state a DFA starts in, at the start of a row or elsewhere
+int dfaStart(struct regex* re, struct dfa* d, int bol) {
+    if (d->start[bol] == -1) {
+        re->markgen++;
+        int n = 0;
+        reClosure(re, re->start, bol, 0, re->set, &n);
+        int flushed = 0;
+        d->start[bol] = dfaState(re, d, n, &flushed);
+    }
+    return d->start[bol];
+}
+
+// Return the state after a byte, building the transition the first time
+// it is taken
+// An unanchored DFA can start a new match at every byte
+int dfaNext(struct regex* re, struct dfa* d, int state, unsigned char c) {
+    struct dfaState* s = d->states[state];
+    if (s->next[c] != -1) {
+        return s->next[c];
+    }
+
+    re->markgen++;
+    int n = 0;
+    for (int j = 0; j < s->n; j++) {
+        struct reNode* nd = &re->nodes[s->set[j]];
+        if (nd->op == RE_CLASS && (nd->cls[c >> 5] >> (c & 31)) & 1) {
+            reClosure(re, nd->out, 0, 0, re->set, &n);
+        }
+    }
+    if (!d->anchored) {
+        reClosure(re, re->start, 0, 0, re->set, &n);
+    }
+
+    int flushed = 0;
+    int next = dfaState(re, d, n, &flushed);
+    if (!flushed) {
+        s->next[c] = next;
+    }
+    return next;
+}
+
+// Return where the match that ends first in s[from, len) ends, or -1
+int reFirstEnd(struct regex* re, const char* s, int len, int from) {
+    struct dfa* d = &re->fwd;
+    int state = dfaStart(re, d, from == 0);
+    if (d->states[state]->accept) {
+        return from;
+    }
+    for (int i = from; i < len; i++) {
+        state = dfaNext(re, d, state, (unsigned char)s[i]);
+        if (d->states[state]->accept) {
+            return i + 1;
+        }
+    }
+    return d->states[state]->accepteol ? len : -1;
+}
+
+// Return where the longest match starting at a position in s ends, or -1
+int reLongestAt(struct regex* re, const char* s, int len, int start) {
+    struct dfa* d = &re->anchored;
+    int state = dfaStart(re, d, start == 0);
+    int end = d->states[state]->accept ? start : -1;
+    int i;
+    for (i = start; i < len; i++) {
+        state = dfaNext(re, d, state, (unsigned char)s[i]);
+        if (d->states[state]->n == 0) {
+            return end;
+        }
+        if (d->states[state]->accept) {
+            end = i + 1;
+        }
+    }
+    return d->states[state]->accepteol ? len : end;
+}
+
+// Add the threads for a node and what it reaches without consuming a byte to
+// reSearch()'s node set t, each part of a match starting at start
+void reAddThreads(struct regex* re, int t, int node, int bol, int eol, int start, int* n) {
+    int first = *n;
+    reClosure(re, node, bol, eol, re->threads[t], n);
+    for (int j = first; j < *n; j++) {
+        re->starts[t][j] = start;
+    }
+}
+
+// Return the start of the leftmost match in s at or after a column, or -1,
+// and the length of the longest match there
+// The forward DFA rejects rows without a match and finds where the earliest
+// match ends, after which no leftmost match can start. One pass of the NFA
+// then follows every thread with where its match started. Threads are kept
+// in order of their start, and a node is only kept for the first thread to
+// reach it, as later ones can only match the same text from further right.
+// Once a match is seen, threads starting after it are dropped, so the pass
+// ends as soon as the longest match from the leftmost start is known
+int reSearch(struct regex* re, const char* s, int len, int from, int* matchlen) {
+    int firstend = reFirstEnd(re, s, len, from);
+    if (firstend == -1) {
+        return -1;
+    }
+
+    int beststart = -1;
+    int bestend = -1;
+    int t = 0;
+    int n = 0;
+    re->markgen++;
+    reAddThreads(re, t, re->start, from == 0, from == len, from, &n);
+    for (int i = from; n > 0; i++) {
+        // The match node is reached once per position, by its leftmost thread
+        for (int j = 0; j < n; j++) {
+            int start = re->starts[t][j];
+            if (re->nodes[re->threads[t][j]].op == RE_MATCH &&
+                (beststart == -1 || start <= beststart)) {
+                beststart = start;
+                bestend = i;
+            }
+        }
+        if (i == len) {
+            break;
+        }
+
+        unsigned char c = (unsigned char)s[i];
+        int next = 0;
+        re->markgen++;
+        for (int j = 0; j < n; j++) {
+            if (beststart != -1 && re->starts[t][j] > beststart) {
+                break;
+            }
+            struct reNode* nd = &re->nodes[re->threads[t][j]];
+            if (nd->op == RE_CLASS && (nd->cls[c >> 5] >> (c & 31)) & 1) {
+                reAddThreads(re, !t, nd->out, 0, i + 1 == len, re->starts[t][j], &next);
+            }
+        }
+        if (beststart == -1 && i + 1 <= firstend) {
+            reAddThreads(re, !t, re->start, 0, i + 1 == len, i + 1, &next);
+        }
+        t = !t;
+        n = next;
+    }
+    if (beststart == -1) {
+        return -1;
+    }
+    *matchlen = bestend - beststart;
+    return beststart;
+}
+
+/*** overlay ***/
+
+// Draw a span of a row in a highlight class until the overlay is cleared
+// Spans are in chars columns, so the row needs no rendering until it is drawn
+void editorOverlayAdd(int row, int start, int end, unsigned char hl) {
+    if (E.numoverlay == E.overlaycap) {
+        E.overlaycap = E.overlaycap ? E.overlaycap * 2 : 8;
+        E.overlay = realloc(E.overlay, sizeof(struct hlrange) * E.overlaycap);
+        if (E.overlay == NULL) {
+            die("realloc");
+        }
+    }
+    struct hlrange* r = &E.overlay[E.numoverlay++];
+    r->row = row;
+    r->start = start;
+    r->end = end;
+    r->hl = hl;
+}
+
+// Remove every span from the overlay
+void editorOverlayClear(void) {
+    E.numoverlay = 0;
+}
+
+// Paint the overlay spans of a row over len highlight classes drawn from
+// render column coloff
+void editorOverlayDraw(int at, erow* row, unsigned char* hl, int coloff, int len) {
+    for (int j = 0; j < E.numoverlay; j++) {
+        struct hlrange* r = &E.overlay[j];
+        if (r->row != at) {
+            continue;
+        }
+        int from = editorRowCxToRx(row, r->start) - coloff;
+        int to = editorRowCxToRx(row, r->end) - coloff;
+        if (from < 0) {
+            from = 0;
+        }
+        if (to > len) {
+            to = len;
+        }
+        if (from < to) {
+            memset(&hl[from], r->hl, to - from);
+        }
+    }
+}
+
+/*** find ***/
+
+// Return the first match of the search query in a row at or after a column,
+// or -1 if there is none, storing its length in len
+int editorMatchInRow(erow* row, int from, int* len) {
+    struct matchindex* mi = &E.matches;
+    if (from > row->size) {
+        return -1;
+    }
+    if (mi->re) {
+        return reSearch(mi->re, row->chars, row->size, from, len);
+    }
+    *len = mi->qlen;
+    const char* match = searchMemory(&row->chars[from], row->size - from, mi->query, mi->qlen);
+    return match ? match - row->chars : -1;
+}
+
+// Return the length of the match of the search query at a column of a row
+int editorMatchLength(erow* row, int col) {
+    struct matchindex* mi = &E.matches;
+    if (mi->re) {
+        return reLongestAt(mi->re, row->chars, row->size, col) - col;
+    }
+    return mi->qlen;
+}
+
+// Return the first row in [from, to) with a match of the search query,
+// or -1 if there is none
+int editorMatchNextRow(int from, int to) {
+    struct matchindex* mi = &E.matches;
+    if (mi->re) {
+        for (int at = from; at < to; at++) {
+            erow* row = editorRowAt(at);
+            if (reFirstEnd(mi->re, row->chars, row->size, 0) != -1) {
+                return at;
+            }
+        }
+        return -1;
+    }
+    int col;
+    return editorSearchRows(from, to, mi->query, mi->qlen, &col);
+}
+
+// Return the match of the search query in a row that follows the one at col
+// of length len, or the first match when col is -1, storing its length in
+// nlen, or -1 if there is none
+// Matches are taken left to right without overlapping, and an empty match
+// right after another match is not taken, as in sed, so that finding and
+// replacing see the same matches
+int editorMatchNext(erow* row, int col, int len, int* nlen) {
+    int pos = 0;
+    int prevend = -1;
+    if (col != -1) {
+        // An empty match covers nothing, so the search goes on after the
+        // character following it
+        pos = len ? col + len : col + 1;
+        prevend = col + len;
+    }
+    while ((col = editorMatchInRow(row, pos, nlen)) != -1) {
+        if (*nlen == 0 && col == prevend) {
+            pos = col + 1;
+            continue;
+        }
+        return col;
+    }
+    return -1;
+}
+
+// Return the first match of the search query in a row at or after a column,
+// or -1 if there is none
+int editorMatchFrom(erow* row, int from) {
+    int len = 0;
+    int col = editorMatchNext(row, -1, 0, &len);
+    while (col != -1 && col < from) {
+        col = editorMatchNext(row, col, len, &len);
+    }
+    return col;
+}
+
+// Return the last match of the search query in a row before a column,
+// or -1 if there is none
+int editorMatchBeforeInRow(erow* row, int before) {
+    int last = -1;
+    int len = 0;
+    int col = editorMatchNext(row, -1, 0, &len);
+    while (col != -1 && col < before) {
+        last = col;
+        col = editorMatchNext(row, col, len, &len);
+    }
+    return last;
+}
+
+// Return the number of matches of the query in a row
+int editorMatchCount(erow* row) {
+    int count = 0;
+    int len = 0;
+    int col = editorMatchNext(row, -1, 0, &len);
+    while (col != -1) {
+        count++;
+        col = editorMatchNext(row, col, len, &len);
+    }
+    return count;
+}
+
+// Record a row holding count matches at the end of the match index
+void editorMatchPush(int row, int count) {
+    struct matchindex* mi = &E.matches;
+    if (mi->numrows == mi->cap) {
+        mi->cap = mi->cap ? mi->cap * 2 : 64;
+        mi->rows = realloc(mi->rows, sizeof(struct matchrow) * mi->cap);
+        if (mi->rows == NULL) {
+            die("realloc");
+        }
+    }
+    mi->rows[mi->numrows].row = row;
+    mi->rows[mi->numrows].first = mi->total;
+    mi->numrows++;
+    mi->total += count;
+}
+
+// Return whether the match index still has rows to scan
+int editorMatchPending(void) {
+    return E.matches.query != NULL && E.matches.scanned < E.numrows;
+}
+
+// Scan up to max more rows into the match index
+// Return whether the index changed
+int editorMatchStep(int max) {
+    struct matchindex* mi = &E.matches;
+    if (!editorMatchPending()) {
+        return 0;
+    }
+    int to = mi->scanned + max;
+    if (to > E.numrows || to < 0) {
+        to = E.numrows;
+    }
+    int at = mi->scanned;
+    while ((at = editorMatchNextRow(at, to)) != -1) {
+        editorMatchPush(at, editorMatchCount(editorRowAt(at)));
+        at++;
+    }
+    mi->scanned = to;
+    return 1;
+}
+
+// Return the first entry of the match index for a row at or after a row
+// Entries are in row order, so this is a bisection
+int editorMatchLookup(int row) {
+    struct matchindex* mi = &E.matches;
+    int lo = 0, hi = mi->numrows;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (mi->rows[mid].row < row) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Drop the match index and stop searching
+void editorMatchFree(void) {
+    struct matchindex* mi = &E.matches;
+    free(mi->query);
+    free(mi->rows);
+    reFree(mi->re);
+    mi->query = NULL;
+    mi->re = NULL;
+    mi->bad = 0;
+    mi->qlen = 0;
+    mi->rows = NULL;
+    mi->numrows = 0;
+    mi->cap = 0;
+    mi->total = 0;
+    mi->scanned = 0;
+    mi->current = -1;
+}
+
+// Point the match index at a new query
+// When a literal query only grew, the rows already found are refined in
+// place, since every match of the new query is also a match of the old one
+void editorMatchSetQuery(const char* query) {
+    struct matchindex* mi = &E.matches;
+    size_t qlen = strlen(query);
+    if (mi->query && !mi->regex && qlen >= mi->qlen && memcmp(query, mi->query, mi->qlen) == 0) {
+        free(mi->query);
+        mi->query = strdup(query);
+        mi->qlen = qlen;
+
+        int kept = 0;
+        mi->total = 0;
+        for (int j = 0; j < mi->numrows; j++) {
+            int row = mi->rows[j].row;
+            int count = editorMatchCount(editorRowAt(row));
+            if (count) {
+                mi->rows[kept].row = row;
+                mi->rows[kept].first = mi->total;
+                mi->total += count;
+                kept++;
+            }
+        }
+        mi->numrows = kept;
+    } else {
+        editorMatchFree();
+        mi->query = strdup(query);
+        mi->qlen = qlen;
+        if (mi->regex) {
+            mi->re = reCompile(query);
+            // Nothing to scan for until the pattern is complete
+            if (mi->re == NULL) {
+                mi->bad = 1;
+                mi->scanned = E.numrows;
+            }
+        }
+    }
+    mi->current = -1;
+}
+
+// Make the match at a column of an indexed row the current match
+void editorMatchSelect(int entry, int col) {
+    struct matchindex* mi = &E.matches;
+    erow* row = editorRowAt(mi->rows[entry].row);
+    mi->current = entry;
+    mi->col = col;
+    mi->len = editorMatchLength(row, col);
+
+    // Number the match among the matches before it in its row
+    mi->ordinal = 0;
+    int len = 0;
+    int c = editorMatchNext(row, -1, 0, &len);
+    while (c != -1 && c < col) {
+        mi->ordinal++;
+        c = editorMatchNext(row, c, len, &len);
+    }
+}
+
+// Select the first match at or after a position, wrapping around to the
+// first match in the file, scanning as far as needed to find it
+// Return whether there is a match
+int editorMatchSeek(int row, int col) {
+    struct matchindex* mi = &E.matches;
+    while (1) {
+        int entry = editorMatchLookup(row);
+        if (entry < mi->numrows) {
+            int c = (mi->rows[entry].row == row) ? editorMatchFrom(editorRowAt(row), col) : -1;
+            if (c != -1) {
+                editorMatchSelect(entry, c);
+                return 1;
+            }
+            // Nothing left in the starting row, so take the next indexed row
+            if (mi->rows[entry].row == row) {
+                entry++;
+            }
+            if (entry < mi->numrows) {
+                editorMatchSelect(entry, editorMatchFrom(editorRowAt(mi->rows[entry].row), 0));
+                return 1;
+            }
+        }
+        if (!editorMatchPending()) {
+            break;
+        }
+        editorMatchStep(KILO_MATCH_STEP);
+    }
+    if (mi->numrows == 0) {
+        return 0;
+    }
+    editorMatchSelect(0, editorMatchFrom(editorRowAt(mi->rows[0].row), 0));
+    return 1;
+}
+
+// Select the match before the current one, wrapping around to the last
+// match in the file
+void editorMatchPrev(void) {
+    struct matchindex* mi = &E.matches;
+    erow* row = editorRowAt(mi->rows[mi->current].row);
+    int col = editorMatchBeforeInRow(row, mi->col);
+    if (col != -1) {
+        editorMatchSelect(mi->current, col);
+        return;
+    }
+    int entry = mi->current - 1;
+    if (entry < 0) {
+        // Wrapping needs the rest of the file indexed
+        while (editorMatchPending()) {
+            editorMatchStep(KILO_MATCH_STEP);
+        }
+        entry = mi->numrows - 1;
+    }
+    row = editorRowAt(mi->rows[entry].row);
+    editorMatchSelect(entry, editorMatchBeforeInRow(row, row->size + 1));
+}
+
+void editorFindCallback(char* query, int key) {
+    struct matchindex* mi = &E.matches;
+
+    // The highlight of the previous match goes away with the overlay
+    editorOverlayClear();
+
+    // Search forward and backward using arrow keys
+    if (key == '\r' || key == '\x1b') {
+        editorMatchFree();
+        return;
+    }
+    // Ctrl-R switches between literal and regex search
+    if (key == CTRL_KEY('r')) {
+        mi->regex = !mi->regex;
+        free(mi->query);
+        mi->query = NULL;
+    }
+
+    int found;
+    if ((key == ARROW_RIGHT || key == ARROW_DOWN) && mi->current != -1) {
+        found = editorMatchSeek(mi->rows[mi->current].row, mi->col + 1);
+    } else if ((key == ARROW_LEFT || key == ARROW_UP) && mi->current != -1) {
+        editorMatchPrev();
+        found = 1;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP) {
+        found = 0;
+    } else if (query[0] == '\0') {
+        editorMatchFree();
+        found = 0;
+    } else {
+        // Stay on the current match if the new query still matches there,
+        // otherwise move on to the next match
+        int row = 0, col = 0;
+        if (mi->current != -1) {
+            row = mi->rows[mi->current].row;
+            col = mi->col;
+        }
+        editorMatchSetQuery(query);
+        found = editorMatchSeek(row, col);
+    }
+
+    if (found) {
+        int current = mi->rows[mi->current].row;
+        E.cy = current;
+        E.cx = mi->col;
+        E.rowoff = E.numrows;
+
+        // Highlight matching text when the row is drawn
+        editorOverlayAdd(current, mi->col, mi->col + mi->len, HL_MATCH);
+    }
+}
+
+void editorFind(void) {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+
+    char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-R: regex)", editorFindCallback, 0);
+
+    if (query) {
+        free(query);
+    } else {
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
+    }
+}
+
+// Find the matches of the search query in a row, storing (column, length)
+// pairs in spans
+// Return the number of matches
+int editorReplaceSpans(erow* row, int** spans, int* cap) {
+    int n = 0;
+    int len = 0;
+    int col = -1;
+    while ((col = editorMatchNext(row, col, len, &len)) != -1) {
+        if (2 * (n + 1) > *cap) {
+            *cap = *cap ? *cap * 2 : 64;
+            *spans = realloc(*spans, sizeof(int) * *cap);
+            if (*spans == NULL) {
+                die("realloc");
+            }
+        }
+        (*spans)[2 * n] = col;
+        (*spans)[2 * n + 1] = len;
+        n++;
+    }
+    return n;
+}
+
+// Replace every match of a query in the file
+// All matches are indexed first, then each row holding one is rewritten
+// once into a single copy in the text storage and highlighted again
+void editorReplaceAll(const char* query, const char* with) {
+    struct matchindex* mi = &E.matches;
+    long long start = editorNow();
+    size_t wlen = strlen(with);
+
+    editorMatchFree();
+    editorMatchSetQuery(query);
+    if (mi->bad) {
+        editorMatchFree();
+        editorSetStatusMessage("bad regex");
+        return;
+    }
+    while (editorMatchPending()) {
+        editorMatchStep(KILO_MATCH_STEP);
+    }
+
+    int* spans = NULL;
+    int cap = 0;
+    int replaced = 0;
+    int rows = 0;
+    for (int j = 0; j < mi->numrows; j++) {
+        erow* row = editorRowAt(mi->rows[j].row);
+        int n = editorReplaceSpans(row, &spans, &cap);
+        if (n == 0) {
+            continue;
+        }
+
+        // Size the new row, then copy the text between the matches and the
+        // replacements into it
+        size_t size = row->size;
+        for (int k = 0; k < n; k++) {
+            size += wlen - spans[2 * k + 1];
+        }
+        // The edit spans the text from the first match to the end of the last
+        int first = spans[0];
+        int end = spans[2 * (n - 1)] + spans[2 * n - 1];
+        int newend = end + (int) size - row->size;
+        editorUndoBegin(mi->rows[j].row, first, mi->rows[j].row, end, UNDO_EDIT);
+        char* p = textAlloc(size);
+        char* q = p;
+        int pos = 0;
+        for (int k = 0; k < n; k++) {
+            int col = spans[2 * k];
+            memcpy(q, &row->chars[pos], col - pos);
+            q += col - pos;
+            memcpy(q, with, wlen);
+            q += wlen;
+            pos = col + spans[2 * k + 1];
+        }
+        memcpy(q, &row->chars[pos], row->size - pos);
+
+        editorRowDisown(row);
+        row->chars = p;
+        row->size = size;
+        editorUpdateRow(row);
+        if (mi->rows[j].row == E.cy && E.cx > row->size) {
+            E.cx = row->size;
+        }
+        editorUndoEnd(mi->rows[j].row, newend);
+        replaced += n;
+        rows++;
     }
-    // Delete row
-    editorFreeRow(&E.row[at]);
-    // Move memory for rows after deleted row
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    free(spans);
+    editorMatchFree();
 
-    for (int j = at; j < E.numrows - 1; j++) {
-        E.row[j].idx--;
+    if (replaced) {
+        E.dirty++;
     }
 
-    E.numrows--;
-    E.dirty++;
+    long long ms = editorNow() - start;
+    editorSetStatusMessage("Replaced %d matches in %d rows in %lld ms (%lld/s)",
+        replaced, rows, ms, replaced * 1000LL / (ms ? ms : 1));
 }
 
-// Insert a character into a row at an index
-void editorRowInsertChar(erow* row, int at, int c) {
-    if (at < 0 || at > row->size) {
-        at = row->size;
+// Prompt for a query and its replacement and replace every match
+// The query is a regex when the last search was
+void editorReplace(void) {
+    char* query = editorPrompt(E.matches.regex ? "Replace regex: %s (ESC to cancel)" :
+        "Replace: %s (ESC to cancel)", NULL, 0);
+    if (query == NULL) {
+        return;
     }
-    // Reallocate memory and move characters before and after inserted character
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    // Insert character
-    row->chars[at] = c;
-    // Update the row in the editor
-    editorUpdateRow(row);
-    E.dirty++;
+    // Replacing with nothing deletes the matches
+    char* with = editorPrompt("Replace with: %s (ESC to cancel)", NULL, 1);
+    if (with) {
+        editorReplaceAll(query, with);
+        free(with);
+    }
+    free(query);
 }
 
-// Append a string of any size to the end of a row
-void editorRowAppendString(erow* row, char* s, size_t len) {
-    // Reallocate memory for new size of row
-    row->chars = realloc(row->chars, row->size + len + 1);
-    // Copy memory of string into row
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    // Append null terminator
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+/*** append buffer ***/
+
+// Append buffer constructor
+#define ABUF_INIT {NULL, 0, 0}
+
+// Make room for at least n bytes in an append buffer, doubling its capacity
+// Return whether the room is available
+int abReserve(struct abuf* ab, int n) {
+    if (n <= ab->cap) {
+        return 1;
+    }
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < n) {
+        cap *= 2;
+    }
+    char* new = realloc(ab->b, cap);
+    if (new == NULL) {
+        return 0;
+    }
+    ab->b = new;
+    ab->cap = cap;
+    return 1;
 }
 
-// Delete a character from a row at an index
-void editorRowDelChar(erow* row, int at) {
-    if (at < 0 || at >= row->size) {
+// Append a string to an append buffer
+// Uses same interface as write(), except writes to the buffer rather than to stdout
+void abAppend(struct abuf* ab, const char* s, int len) {
+    if (!abReserve(ab, ab->len + len)) {
         return;
     }
-    // Move row contents before and after character
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    // Shrink row size and update row
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    memcpy(&ab->b[ab->len], s, len);
+    ab->len += len;
 }
 
-/*** editor operations ***/
+// Empty an append buffer, keeping its memory for the next use
+void abReset(struct abuf* ab) {
+    ab->len = 0;
+}
 
-void editorInsertChar(int c) {
-    // Add new row to end of file when needed
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
-    }
-    // Insert character and move cursor to right of character
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+// Append buffer destructor
+void abFree(struct abuf* ab) {
+    free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->cap = 0;
 }
 
-// Insert a new line (e.g. with Enter key)
-void editorInsertNewLine(void) {
-    // Insert new blank row before current line if at beginning of line
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
-    } else {
-        // Split the current line into two rows
-        erow* row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        // Update pointer to avoid invalidation
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+/*** frame ***/
+
+// Allocate both frames for a screen size, forgetting what is on screen
+void frameResize(int rows, int cols) {
+    struct frame* frames[] = {&E.frame, &E.shadow};
+    for (int j = 0; j < 2; j++) {
+        struct frame* f = frames[j];
+        free(f->chars);
+        free(f->attrs);
+        f->rows = rows;
+        f->cols = cols;
+        f->chars = malloc(rows * cols);
+        f->attrs = malloc(rows * cols);
+        if (f->chars == NULL || f->attrs == NULL) {
+            die("malloc");
+        }
+        f->cy = 0;
+        f->cx = 0;
     }
-    E.cy++;
-    E.cx = 0;
+    E.screenvalid = 0;
+
+    // A full repaint needs about one byte per cell plus the escape sequences
+    abReserve(&E.ab, 2 * rows * cols);
 }
 
-// Delete a character
-void editorDelChar(void) {
-    // Return if cursor is beyond the last line
-    if (E.cy == E.numrows) {
-        return;
+// Fill a row of a frame with blanks
+void frameClearRow(struct frame* f, int y) {
+    memset(&f->chars[y * f->cols], ' ', f->cols);
+    memset(&f->attrs[y * f->cols], HL_NORMAL, f->cols);
+}
+
+// Write characters with one attribute into a frame row, clipped to the row
+void frameWrite(struct frame* f, int y, int x, const char* s, int len, unsigned char attr) {
+    if (x + len > f->cols) {
+        len = f->cols - x;
     }
-    // Return if cursor is at the beginning of the first line
-    if (E.cx == 0 && E.cy == 0) {
+    if (len <= 0) {
         return;
     }
+    memcpy(&f->chars[y * f->cols + x], s, len);
+    memset(&f->attrs[y * f->cols + x], attr, len);
+}
 
-    erow* row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    } else {
-        // Handle case where cursor is at beginning of line
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+// Format the escape sequence that selects each cell attribute once
+void frameInitAttrs(void) {
+    for (int attr = 0; attr < 256; attr++) {
+        int hl = attr & ~ATTR_INVERSE;
+        int color = (hl == HL_NORMAL) ? 39 : editorSyntaxToColor(hl);
+        E.attresclen[attr] = snprintf(E.attresc[attr], sizeof(E.attresc[attr]),
+            "\x1b[%d;%dm", (attr & ATTR_INVERSE) ? 7 : 27, color);
     }
 }
 
-/*** file i/o ***/
+// Append what it takes to turn the screen (as recorded in the shadow frame)
+// into the current frame, rewriting only the spans of cells that changed
+// Return whether anything was appended
+int editorFlushFrame(struct abuf* ab) {
+    struct frame* f = &E.frame;
+    struct frame* s = &E.shadow;
+    int changed = 0;
+
+    // Start from a blank screen when its contents are unknown
+    if (!E.screenvalid) {
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        memset(s->chars, ' ', s->rows * s->cols);
+        memset(s->attrs, HL_NORMAL, s->rows * s->cols);
+        E.screenvalid = 1;
+        changed = 1;
+    }
 
-// Open a file
-void editorOpen(char *filename) {
-    // Get filename to display in status bar
-    free(E.filename);
-    E.filename = strdup(filename);
+    // Attribute the terminal is drawing with; frames always end on normal
+    unsigned char attr = HL_NORMAL;
+    for (int y = 0; y < f->rows; y++) {
+        char* nc = &f->chars[y * f->cols];
+        unsigned char* na = &f->attrs[y * f->cols];
+        char* oc = &s->chars[y * s->cols];
+        unsigned char* oa = &s->attrs[y * s->cols];
+
+        // Cells from blank to the end of the row are blank in the new frame
+        int blank = f->cols;
+        while (blank > 0 && nc[blank - 1] == ' ' && na[blank - 1] == HL_NORMAL) {
+            blank--;
+        }
 
-    editorSelectSyntaxHighlight();
+        int x = 0;
+        while (x < f->cols) {
+            if (nc[x] == oc[x] && na[x] == oa[x]) {
+                x++;
+                continue;
+            }
 
-    // Open specified file, or exit on failure
-    FILE *fp = fopen(filename, "r");
-    if (!fp ) {
-        die("fopen");
-    }
+            // Extend the span over short runs of unchanged cells, which are
+            // cheaper to rewrite than to skip with a cursor move
+            int end = x + 1;
+            for (int k = x + 1; k < f->cols && k - end < KILO_SPAN_GAP; k++) {
+                if (nc[k] != oc[k] || na[k] != oa[k]) {
+                    end = k + 1;
+                }
+            }
+
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+            abAppend(ab, buf, len);
+
+            // Send each run of cells sharing an attribute with one append
+            int stop = end < blank ? end : blank;
+            int k = x;
+            while (k < stop) {
+                int run = k + 1;
+                while (run < stop && na[run] == na[k]) {
+                    run++;
+                }
+                if (na[k] != attr) {
+                    attr = na[k];
+                    abAppend(ab, E.attresc[attr], E.attresclen[attr]);
+                }
+                abAppend(ab, &nc[k], run - k);
+                k = run;
+            }
+            // Erase a blank tail instead of writing spaces
+            if (end > blank) {
+                if (attr != HL_NORMAL) {
+                    attr = HL_NORMAL;
+                    abAppend(ab, "\x1b[m", 3);
+                }
+                abAppend(ab, "\x1b[K", 3);
+                end = f->cols;
+            }
 
-    char* line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    // Read each line from the file
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while ( linelen > 0 && (line[linelen - 1] == '\n' ||
-                                line[linelen - 1] == '\r')) {
-            linelen--;
+            x = end;
+            changed = 1;
         }
-        // Append row to screen
-        editorInsertRow(E.numrows, line, linelen);
     }
 
-    // Free memory and close file
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    if (attr != HL_NORMAL) {
+        abAppend(ab, "\x1b[m", 3);
+    }
+    return changed;
 }
 
-// Serialize all rows to a single string
-char* editorRowsToString(int* buflen) {
-    int totlen = 0;
-    int j;
-    // Add the length of each row to the total length
-    for (j = 0; j < E.numrows; j++) {
-        totlen += E.row[j].size + 1;
-    }
-    *buflen = totlen;
+/*** events ***/
 
-    // Allocate a buffer for the total length of the document
-    char* buf = malloc(totlen);
-    char* p = buf;
-    // Copy all rows into the buffer, using a pointer to track write location
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
-    }
+// Return milliseconds on a clock that only moves forward
+long long editorNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    return buf;
+// Arrange for fn to run once ms milliseconds from now, replacing any earlier
+// arrangement for the same timer
+void editorSetTimer(int id, int ms, void (*fn)(void)) {
+    E.timers[id].due = editorNow() + ms;
+    E.timers[id].fn = fn;
 }
 
-// Save text to a file
-void editorSave(void) {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
+// Run the timers that are due
+// Return milliseconds until the next one, or -1 if none is set
+int editorRunTimers(void) {
+    long long now = editorNow();
+    long long next = -1;
+    for (int id = 0; id < TIMER_COUNT; id++) {
+        struct timer* t = &E.timers[id];
+        if (t->fn == NULL) {
+            continue;
         }
-        editorSelectSyntaxHighlight();
-    }
-
-    // Serialize all rows to a single string
-    int len;
-    char* buf = editorRowsToString(&len);
-
-    // Create a new file if it doesn't exist
-    // and open it with standard read/write permissions
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        // Set file size safely in case write fails
-        if (ftruncate(fd, len) != -1) {
-            // Write serialization buffer to file
-            if (write(fd, buf, len) == len) {
-                // Close file and free writeout buffer
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
+        if (t->due <= now) {
+            void (*fn)(void) = t->fn;
+            t->fn = NULL;
+            fn();
+            continue;
+        }
+        if (next == -1 || t->due - now < next) {
+            next = t->due - now;
         }
-        close(fd);
     }
-    // Free writeout buffer
-    free(buf);
-    editorSetStatusMessage("Could not save file! Error: %s", strerror(errno));
+    return (int)next;
 }
 
-/*** find ***/
+// Forward SIGWINCH to the event loop through the self-pipe
+void editorHandleWinch(int sig) {
+    (void)sig;
+    int saved = errno;
+    write(E.sigpipe[1], "w", 1);
+    errno = saved;
+}
 
-void editorFindCallback(char* query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
+// Set up the self-pipe and the signal handlers that write to it
+void editorInitEvents(void) {
+    if (pipe(E.sigpipe) == -1) {
+        die("pipe");
+    }
+    for (int j = 0; j < 2; j++) {
+        fcntl(E.sigpipe[j], F_SETFL, fcntl(E.sigpipe[j], F_GETFL) | O_NONBLOCK);
+        fcntl(E.sigpipe[j], F_SETFD, FD_CLOEXEC);
+    }
 
-    // Infra for saving existing match highlighting
-    static int saved_hl_line;
-    static char* saved_hl = NULL;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorHandleWinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) {
+        die("sigaction");
+    }
 
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+    for (int id = 0; id < TIMER_COUNT; id++) {
+        E.timers[id].fn = NULL;
     }
+}
 
-    // Search forward and backward using arrow keys
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
+// Lay out a screen of rows x cols: text rows, then the status bar and the
+// message bar. Terminals too short for all three keep one text row and drop
+// the bars (see editorDrawStatusBar())
+void editorSetScreenSize(int rows, int cols) {
+    if (rows < 1) {
+        rows = 1;
     }
+    E.screenrows = rows > 3 ? rows - 2 : 1;
+    E.screencols = cols;
+    frameResize(rows, cols);
+}
 
-    // Iterate through rows looking for next/previous match
-    if (last_match == -1) {
-        direction = 1;
+// Adopt the terminal's new size and repaint
+// Only the terminal driver is asked, so a resize never waits on the terminal;
+// if it cannot tell, the size found at startup is kept
+void editorResize(void) {
+    int rows, cols;
+    if (getWindowSizeIoctl(&rows, &cols) == -1) {
+        return;
     }
-    int current = last_match;
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) {
-            current = E.numrows - 1;
-        } else if (current == E.numrows) {
-            current = 0;
-        }
-
-        erow* row = &E.row[current];
-        char* match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-
-            // Save existing highlighting
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            // Highlight matching text
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+    if (rows == E.frame.rows && cols == E.frame.cols) {
+        return;
     }
+    // Terminals may reflow or scroll their contents when resized, so the new
+    // frames start out unknown and the next refresh repaints every cell
+    editorSetScreenSize(rows, cols);
+    editorRefreshScreen();
 }
 
-void editorFind(void) {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+// Return whether deferred work remains
+int editorIdlePending(void) {
+    return E.syntaxrows < E.numrows || editorMatchPending();
+}
 
-    char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+// Do deferred work in slices for as long as no input is waiting:
+// lexing first, since it affects what is on screen, then indexing matches
+void editorIdle(void) {
+    int redraw = 0;
+    while (editorIdlePending()) {
+        if (E.syntaxrows < E.numrows) {
+            redraw |= editorSyntaxStep(KILO_SYNTAX_STEP);
+        } else {
+            redraw |= editorMatchStep(KILO_MATCH_STEP);
+        }
 
-    if (query) {
-        free(query);
-    } else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+        int pending;
+        if (ioctl(STDIN_FILENO, FIONREAD, &pending) == -1 || pending > 0) {
+            break;
+        }
+    }
+    if (redraw) {
+        editorRefreshScreen();
     }
 }
 
-/*** append buffer ***/
-
-// Append buffer allows update of entire screen at once each refresh
-struct abuf {
-    char *b;    // pointer to buffer
-    int len;    // length of buffer
-};
-
-// Append buffer constructor
-#define ABUF_INIT {NULL, 0}
+// Sleep until input is ready, handling signals, timers and deferred work
+// in the meantime
+void editorWait(void) {
+    while (1) {
+        // A save finishes once no prompt is on the message bar, since it
+        // shows a message and may point the rows at the new file
+        if (!E.prompting && editorSaveFinished()) {
+            editorSaveDone();
+            editorRefreshScreen();
+        }
+        editorIdle();
+        int timeout = editorRunTimers();
+        // Keep polling without sleeping while deferred work remains
+        if (editorIdlePending()) {
+            timeout = 0;
+        }
 
-// Append a string to an append buffer
-// Uses same interface as write(), except writes to the buffer rather than to stdout
-void abAppend(struct abuf* ab, const char* s, int len) {
-    char *new  = realloc(ab->b, ab->len + len);
+        struct pollfd fds[2] = {
+            {STDIN_FILENO, POLLIN, 0},
+            {E.sigpipe[0], POLLIN, 0},
+        };
+        if (poll(fds, 2, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("poll");
+        }
 
-    if (new == NULL) {
-        return;
+        // The pipe carries a 'w' for each resize signal and an 's' when the
+        // writer thread is done, which only wakes the loop: an 's' can outlive
+        // its save once Ctrl-Q has joined the thread
+        // Resizing by dragging a window edge sends a burst of signals;
+        // handle at most one per KILO_RESIZE_DELAY
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            ssize_t n;
+            int resized = 0;
+            while ((n = read(E.sigpipe[0], buf, sizeof(buf))) > 0) {
+                resized |= memchr(buf, 'w', n) != NULL;
+            }
+            if (resized && E.timers[TIMER_RESIZE].fn == NULL) {
+                editorSetTimer(TIMER_RESIZE, KILO_RESIZE_DELAY, editorResize);
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            return;
+        }
     }
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
-}
-
-// Append buffer destructor
-void abFree(struct abuf* ab) {
-    free(ab->b);
 }
 
 /*** input ***/
 
 // Prompt user to input a file name when saving, using status bar
-char* editorPrompt(char* prompt, void(*callback)(char*, int)) {
+// Enter only accepts an empty answer if allowempty is set
+char* editorPrompt(char* prompt, void(*callback)(char*, int), int allowempty) {
     size_t bufsize = 128;
     char* buf = malloc(bufsize);
 
     size_t buflen = 0;
     buf[0] = '\0';
 
+    // Keeps a background save from drawing over the prompt (see editorWait())
+    E.prompting = 1;
     while (1) {
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        // Repaint once all queued keys have been handled
+        if (!editorInputPending()) {
+            editorRefreshScreen();
+        }
 
         int c = editorReadKey();
+        // Modified keys (e.g. Ctrl-Right) act like the plain key
+        if (c >= ARROW_LEFT) {
+            c &= ~KEY_MODS;
+        }
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
             if (buflen != 0) {
                 buf[--buflen] = '\0';
             }
         } else if (c == '\x1b') {
+            E.prompting = 0;
             editorSetStatusMessage("");
             if (callback) {
                 callback(buf, c);
@@ -944,7 +4583,8 @@ char* editorPrompt(char* prompt, void(*callback)(char*, int)) {
             free(buf);
             return NULL;
         } else if (c == '\r') {
-            if (buflen != 0 ) {
+            if (buflen != 0 || allowempty) {
+                E.prompting = 0;
                 editorSetStatusMessage("");
                 if (callback) {
                     callback(buf, c);
@@ -969,7 +4609,7 @@ char* editorPrompt(char* prompt, void(*callback)(char*, int)) {
 // Move cursor using WASD
 void editorMoveCursor(int key) {
     // Get current row to do horizontal scrolling checks
-    erow* row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow* row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
     switch (key) {
         case ARROW_LEFT: {
@@ -979,7 +4619,7 @@ void editorMoveCursor(int key) {
                 // Moving left at the start of a line moves to the previous line
                 // and places the cursor all the way to the right
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         }
@@ -1009,7 +4649,43 @@ void editorMoveCursor(int key) {
     }
 
     // Snaps the cursor to the end of the line (cursor will not move into whitespace)
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
+    int rowlen = row ? row->size : 0;
+    if (E.cx > rowlen) {
+        E.cx = rowlen;
+    }
+}
+
+// Move the cursor to a clicked or dragged-over cell, or scroll with the wheel
+void editorMouse(void) {
+    struct mouseEvent* m = &E.mouse;
+    if (m->button & 64) {
+        // Wheel: button 64 scrolls up and 65 down, taking the cursor along
+        // when it would leave the screen
+        E.rowoff += (m->button & 1) ? KILO_WHEEL_ROWS : -KILO_WHEEL_ROWS;
+        if (E.rowoff > E.numrows - 1) {
+            E.rowoff = E.numrows - 1;
+        }
+        if (E.rowoff < 0) {
+            E.rowoff = 0;
+        }
+        if (E.cy < E.rowoff) {
+            E.cy = E.rowoff;
+        }
+        if (E.cy >= E.rowoff + E.screenrows) {
+            E.cy = E.rowoff + E.screenrows - 1;
+        }
+    } else if ((m->button & 3) == 0 && m->press && m->y < E.screenrows) {
+        // Left button pressed or dragged inside the text area
+        E.cy = E.rowoff + m->y;
+        if (E.cy > E.numrows) {
+            E.cy = E.numrows;
+        }
+        E.cx = (E.cy < E.numrows) ? editorRowRxToCx(editorRowAt(E.cy), E.coloff + m->x) : 0;
+    }
+
+    // Snaps the cursor to the end of the line
+    erow* row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen) {
         E.cx = rowlen;
@@ -1021,16 +4697,25 @@ void editorProcessKeypress(void) {
     static int quit_times = KILO_QUIT_TIMES;
 
     int c = editorReadKey();
+    // Modified keys (e.g. Ctrl-Right) act like the plain key
+    if (c >= ARROW_LEFT) {
+        c &= ~KEY_MODS;
+    }
+    // Edits made for this key are undone together
+    E.undo.group++;
 
     switch (c) {
-        // Enter key (carriage return symbol)
-        case '\r': {
+        // Enter key (carriage return symbol), or Ctrl-J (line feed), since
+        // rows never hold a line break
+        case '\r': case CTRL_KEY('j'): {
             editorInsertNewLine();
             break;
         }
 
         // Exit on 'ctrl-q'
         case CTRL_KEY('q'): {
+            // Let a save in progress finish first
+            editorSaveDone();
             // Check if program has been modified after last save.
             // If so, require user to input several "quit" commands before exiting
             if (E.dirty && quit_times > 0) {
@@ -1040,6 +4725,7 @@ void editorProcessKeypress(void) {
                 return;
             }
 
+            editorUndoClose();
             // Clear screen (see editorProcessKeypress()) and exit code 0
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
@@ -1058,7 +4744,7 @@ void editorProcessKeypress(void) {
         }
         case END_KEY: {
             if (E.cy < E.numrows) {
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         }
@@ -1068,6 +4754,20 @@ void editorProcessKeypress(void) {
             break;
         }
 
+        case CTRL_KEY('r'): {
+            editorReplace();
+            break;
+        }
+
+        case CTRL_KEY('z'): {
+            editorUndo();
+            break;
+        }
+        case CTRL_KEY('y'): {
+            editorRedo();
+            break;
+        }
+
         case BACKSPACE: case CTRL_KEY('h'): case DEL_KEY: {
             // Move cursor to the right first if delete key is pressed
             if (c == DEL_KEY) {
@@ -1102,12 +4802,32 @@ void editorProcessKeypress(void) {
             break;
         }
         
-        // Screen refresh
+        // Screen refresh: repaint every cell on the next refresh
         case CTRL_KEY('l') : {
+            E.screenvalid = 0;
+            break;
+        }
+        // Insert pasted text in one step rather than key by key
+        case PASTE_START: {
+            editorPaste();
+            break;
+        }
+
+        case MOUSE_EVENT: {
+            editorMouse();
+            break;
+        }
 
+        // Mouse capture is off by default so the terminal can select text
+        case CTRL_KEY('t'): {
+            editorSetMouseCapture(!E.mousecapture);
+            editorSetStatusMessage("Mouse capture %s", E.mousecapture ? "on" : "off");
+            break;
         }
+
         // Escape key (and other escape sequences)
-        case '\x1b': {
+        // Focus changes are read so their reports never reach the text
+        case '\x1b': case PASTE_END: case FOCUS_IN: case FOCUS_OUT: {
             break;
         }
 
@@ -1126,7 +4846,7 @@ void editorProcessKeypress(void) {
 void editorScroll(void) {
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
 
     // Vertical scrolling
@@ -1151,9 +4871,11 @@ void editorScroll(void) {
 }
 
 // Draw all rows
-void editorDrawRows(struct abuf *ab) {
+void editorDrawRows(struct frame* f) {
     int y;
     for (y = 0; y < E.screenrows; y++) {
+        frameClearRow(f, y);
+
         int filerow = y + E.rowoff;
         // Check whether the current row is part of the text buffer,
         // or whether it is a row after the end of the text buffer
@@ -1173,77 +4895,52 @@ void editorDrawRows(struct abuf *ab) {
                 // Center the welcome message
                 int padding = (E.screencols - welcomelen) / 2;
                 if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while(padding--) {
-                    abAppend( ab, " ", 1);
+                    frameWrite(f, y, 0, "~", 1, HL_NORMAL);
                 }
 
-                abAppend(ab, welcome, welcomelen);
+                frameWrite(f, y, padding, welcome, welcomelen, HL_NORMAL);
             } else {
-                abAppend(ab, "~", 1);
+                frameWrite(f, y, 0, "~", 1, HL_NORMAL);
             }
         } else {
-            // Display contents of current row
-            int len = E.row[filerow].rsize - E.coloff;
+            // Display contents of current row, rendering it if needed
+            erow* row = editorRenderRow(filerow);
+            int len = row->rsize - E.coloff;
             if (len < 0) {
                 len = 0;
             }
             if (len > E.screencols) {
                 len = E.screencols;
             }
-            // abAppend(ab, &E.row[filerow].render[E.coloff], len); // Append multichar substrings
-            // Append substrings char-by-char
-            char* c = &E.row[filerow].render[E.coloff];
-            unsigned char* hl = &E.row[filerow].hl[E.coloff];
-            
-            int current_color = -1;
-            // For each character, append the corresponding highlight color
+            if (len == 0) {
+                continue;
+            }
+
+            // Copy the visible characters and their highlight classes
+            char* c = &f->chars[y * f->cols];
+            unsigned char* hl = &f->attrs[y * f->cols];
+            memcpy(c, &row->render[E.coloff], len);
+            memcpy(hl, &row->hl[E.coloff], len);
+            editorOverlayDraw(filerow, row, hl, E.coloff, len);
+
+            // Turn control characters into printable characters
             int j;
             for (j = 0; j < len; j++) {
-                // Turn control characters into printable characters
                 if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+                    c[j] = (c[j] <= 26) ? '@' + c[j] : '?';
+                    hl[j] |= ATTR_INVERSE;
                 }
             }
-
-            abAppend(ab, "\x1b[39m", 5);
         }
-
-        // Clear each line before redraw
-        abAppend(ab, "\x1b[K", 3);
-        // Add a line break at the end of each row
-        abAppend(ab, "\r\n", 2);
     }
 }
 
 // Draw status bar on 2nd-last row of screen
-void editorDrawStatusBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar(struct frame* f) {
+    int y = E.screenrows;
+    if (y >= f->rows) {
+        return;
+    }
     char status[80], rstatus[80];
     // Print status bar content on left side of screen
     int len = snprintf(
@@ -1252,73 +4949,97 @@ void editorDrawStatusBar(struct abuf *ab) {
         E.filename ? E.filename : "[No Name]", E.numrows,
         // Print indicator if file has been modified
         E.dirty ? "(modified)" : "");
-    // Print current line number on right side of screen
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", 
+    // Print current line number on right side of screen, after the
+    // position of the current search match ("+" while still counting)
+    char search[48] = "";
+    struct matchindex* mi = &E.matches;
+    if (mi->bad) {
+        snprintf(search, sizeof(search), "bad regex | ");
+    } else if (mi->query) {
+        snprintf(search, sizeof(search), "%smatch %d of %d%s | ", mi->regex ? "regex " : "",
+            mi->current == -1 ? 0 : mi->rows[mi->current].first + mi->ordinal + 1,
+            mi->total, editorMatchPending() ? "+" : "");
+    }
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d", search,
         E.syntax ? E.syntax->filetype : "no ft",
         E.cy + 1, E.numrows);
     // Cap length at the number of columns on screen
     if (len > E.screencols) {
         len = E.screencols;
     }
-    // Append accumulated text to status bar
-    abAppend(ab, status, len);
-    // Print remaining characters in status bar as spaces
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
+
+    // The whole bar is drawn in inverted colors
+    frameClearRow(f, y);
+    memset(&f->attrs[y * f->cols], ATTR_INVERSE, f->cols);
+    frameWrite(f, y, 0, status, len, ATTR_INVERSE);
+    // Right-align the line number if it fits after the status
+    if (len + rlen <= E.screencols) {
+        frameWrite(f, y, E.screencols - rlen, rstatus, rlen, ATTR_INVERSE);
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
 }
 
 // Draw message bar on last row of screen
-void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(struct frame* f) {
+    int y = E.screenrows + 1;
+    if (y >= f->rows) {
+        return;
+    }
+    frameClearRow(f, y);
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) {
         msglen = E.screencols;
     }
     // Only display message if it is less than 5 seconds old
-    if (msglen && time(NULL) - E.statusmsg_time < 5) {
-        abAppend(ab, E.statusmsg, msglen);
+    if (msglen && editorNow() - E.statusmsg_time < KILO_MSG_TIMEOUT) {
+        frameWrite(f, y, 0, E.statusmsg, msglen, HL_NORMAL);
     }
 }
 
-// Clear the screen and draw all rows
+// Draw all rows into the frame, then send only what changed on screen
 void editorRefreshScreen(void) {
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
-
-    // Hide cursor
-    abAppend(&ab, "\x1b[?25l", 6);
-    // Position cursor at top-left corner
-    abAppend(&ab, "\x1b[H", 3);
-
     // Draw rows on screen
-    editorDrawRows(&ab);
+    editorDrawRows(&E.frame);
     // Draw status bar at bottom of screen
-    editorDrawStatusBar(&ab);
+    editorDrawStatusBar(&E.frame);
     // Draw message bar at bottom of screen
-    editorDrawMessageBar(&ab);
+    editorDrawMessageBar(&E.frame);
 
     // Position cursor at coordinates stored in editor state E
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-            (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    E.frame.cy = E.cy - E.rowoff;
+    E.frame.cx = E.rx - E.coloff;
+
+    // The buffer keeps the capacity earlier frames grew it to
+    struct abuf* ab = &E.ab;
+    abReset(ab);
+
+    // Hide cursor while cells are redrawn
+    abAppend(ab, "\x1b[?25l", 6);
+    int changed = editorFlushFrame(ab);
+    if (!changed) {
+        // Only the cursor moves, so it can stay visible
+        abReset(ab);
+    }
+
+    if (changed || E.frame.cy != E.shadow.cy || E.frame.cx != E.shadow.cx) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.frame.cy + 1, E.frame.cx + 1);
+        abAppend(ab, buf, len);
+    }
 
     // Show cursor
-    abAppend(&ab, "\x1b[?25h", 6);
+    if (changed) {
+        abAppend(ab, "\x1b[?25h", 6);
+    }
+
+    // The frame just drawn is now what the terminal shows
+    struct frame tmp = E.shadow;
+    E.shadow = E.frame;
+    E.frame = tmp;
 
     // Write entire append buffer to screen at once
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    write(STDOUT_FILENO, ab->b, ab->len);
 }
 
 // Set status bar message (variadic function)
@@ -1331,7 +5052,9 @@ void editorSetStatusMessage(const char* fmt, ...) {
     vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
     va_end(ap);
 
-    E.statusmsg_time = time(NULL);
+    E.statusmsg_time = editorNow();
+    // Clear the message off the screen once it expires
+    editorSetTimer(TIMER_STATUSMSG, KILO_MSG_TIMEOUT, editorRefreshScreen);
 }
 
 // Initialize the editor window
@@ -1344,6 +5067,35 @@ void initEditor(void) {
     E.coloff = 0;
     E.numrows = 0;
     E.row = NULL;
+    E.rowcap = 0;
+    E.gap = 0;
+    E.text.orig = NULL;
+    E.text.origlen = 0;
+    E.text.orig_mapped = 0;
+    E.text.add = NULL;
+    E.undo.buf = NULL;
+    E.undo.base = 0;
+    E.undo.len = 0;
+    E.undo.cap = 0;
+    E.undo.top = 0;
+    E.undo.last = UNDO_NONE;
+    E.undo.open = UNDO_NONE;
+    E.undo.group = 0;
+    E.undo.fd = -1;
+    E.undo.path = NULL;
+    E.undo.synced = 0;
+    E.undo.scratch = NULL;
+    E.undo.scratchcap = 0;
+    E.save.running = 0;
+    E.save.finished = 0;
+    E.save.filename = NULL;
+    E.save.target = NULL;
+    E.save.tmp = NULL;
+    E.save.iov = NULL;
+    E.save.cap = 0;
+    pthread_mutex_init(&E.save.lock, NULL);
+    E.syntaxrows = 0;
+    E.syntaxdirty = -1;
 
     E.filename = NULL;
     E.dirty = 0;
@@ -1352,17 +5104,39 @@ void initEditor(void) {
     E.statusmsg_time = 0;
 
     E.syntax = NULL;
+    E.matches.query = NULL;
+    E.matches.rows = NULL;
+    E.matches.re = NULL;
+    E.matches.regex = 0;
+    editorMatchFree();
+    E.overlay = NULL;
+    E.numoverlay = 0;
+    E.overlaycap = 0;
 
     // Get window size, or exit on failure
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1) {
         die("getWindowSize");
     }
-    // Prevent drawing 2 rows at the bottom of the screen
-    // to reserve space for status bar and message bar
-    E.screenrows -= 2;
+
+    E.frame.chars = NULL;
+    E.frame.attrs = NULL;
+    E.shadow.chars = NULL;
+    E.shadow.attrs = NULL;
+    E.ab = (struct abuf)ABUF_INIT;
+    E.in.head = 0;
+    E.in.tail = 0;
+    E.mousecapture = 0;
+    E.prompting = 0;
+    atexit(editorSaveAbort);
+    // Reserve 2 rows at the bottom of the screen for status bar and message bar
+    editorSetScreenSize(rows, cols);
+    frameInitAttrs();
+    editorInitEvents();
 }
 
 /*** init ***/
+#ifndef KILO_NO_MAIN
 int main(int argc, char* argv[]) {
 
     enableRawMode();
@@ -1373,12 +5147,18 @@ int main(int argc, char* argv[]) {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = replace");
 
     while (1) {
         editorRefreshScreen();
-        editorProcessKeypress();
+        // Apply every key already read before repainting, keeping the view
+        // in step with the cursor since paging keys move relative to it
+        do {
+            editorProcessKeypress();
+            editorScroll();
+        } while (editorInputPending());
     }
 
     return 0;
 }
+#endif
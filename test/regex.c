@@ -0,0 +1,115 @@
+/*** includes ***/
+
+// Build the editor without its main() and test its regex engine directly
+#define KILO_NO_MAIN
+#include "../src/kilo.c"
+
+/*** cases ***/
+
+#define RE_MALFORMED -2
+
+// Search for a pattern in a subject from a column, expecting the leftmost
+// match to start at start (-1 for none, RE_MALFORMED if the pattern must
+// not compile) and to be len bytes long
+struct reCase {
+    const char* pattern;
+    const char* subject;
+    int from;
+    int start;
+    int len;
+};
+
+struct reCase reCases[] = {
+    // Anchors hold only at the ends of the row, not at the search column
+    {"^a", "ba", 0, -1, 0},
+    {"^b", "ba", 0, 0, 1},
+    {"^a", "aa", 1, -1, 0},
+    {"a$", "aba", 0, 2, 1},
+    {"a$", "ab", 0, -1, 0},
+    {"^$", "", 0, 0, 0},
+    {"^ab$", "ab", 0, 0, 2},
+    {"(^|x)b", "b", 0, 0, 1},
+    {"(^|x)b", "axb", 0, 1, 2},
+
+    // Classes
+    {".", "xy", 1, 1, 1},
+    {"[a-c]+", "xxbcaz", 0, 2, 3},
+    {"[^0-9]+", "12ab3", 0, 2, 2},
+    {"[]a]+", "x]a]", 0, 1, 3},
+    {"[a-]+", "x-a-", 0, 1, 3},
+    {"[\\d_]+", "ab1_2c", 0, 2, 3},
+
+    // Class escapes and their negations
+    {"\\d+", "ab123c", 0, 2, 3},
+    {"\\D", "1x", 0, 1, 1},
+    {"\\D+", "12ab3", 0, 2, 2},
+    {"\\w+", "  a_1 ", 0, 2, 3},
+    {"\\W", "ab c", 0, 2, 1},
+    {"\\s+", "a \t b", 0, 1, 3},
+    {"\\S+", "  xy ", 0, 2, 2},
+    {"[\\D]", "7a", 0, 1, 1},
+    {"[^\\D]", "a7", 0, 1, 1},
+    {"\\.", "a.b", 0, 1, 1},
+    {"a\\*", "aa*", 0, 1, 2},
+
+    // Alternation
+    {"cat|dog", "hotdog", 0, 3, 3},
+    {"a|ab|abc", "xabcd", 0, 1, 3},
+    {"(a|b)(c|d)", "xbd", 0, 1, 2},
+
+    // Repetition
+    {"(ab)+", "xababa", 0, 1, 4},
+    {"colou?r", "color", 0, 0, 5},
+    {"a+", "baaab", 0, 1, 3},
+    {"a**", "aa", 0, 0, 2},
+
+    // Empty matches
+    {"x*", "abc", 0, 0, 0},
+    {"x*", "abc", 3, 3, 0},
+    {"a?", "", 0, 0, 0},
+    {"()", "a", 1, 1, 0},
+
+    // Leftmost first, then longest
+    {"a*b|c", "aaac", 0, 3, 1},
+    {"abcd|c", "abcd", 0, 0, 4},
+    {"(a|ab)(c|bcd)", "abcd", 0, 0, 4},
+    {"b|ab*", "abbb", 0, 0, 4},
+    {"(a*)(ab)*b", "aabb", 0, 0, 4},
+
+    // Malformed patterns
+    {"(a", "", 0, RE_MALFORMED, 0},
+    {"a)", "", 0, RE_MALFORMED, 0},
+    {"[ab", "", 0, RE_MALFORMED, 0},
+    {"*a", "", 0, RE_MALFORMED, 0},
+    {"a|*", "", 0, RE_MALFORMED, 0},
+    {"a\\", "", 0, RE_MALFORMED, 0},
+    {"\\q", "", 0, RE_MALFORMED, 0},
+    {"[\\q]", "", 0, RE_MALFORMED, 0},
+};
+
+/*** init ***/
+
+int main(void) {
+    int ncases = sizeof(reCases) / sizeof(reCases[0]);
+    int failed = 0;
+    for (int j = 0; j < ncases; j++) {
+        struct reCase* t = &reCases[j];
+        struct regex* re = reCompile(t->pattern);
+        int start = RE_MALFORMED;
+        int len = 0;
+        if (re) {
+            start = reSearch(re, t->subject, strlen(t->subject), t->from, &len);
+            if (start == -1) {
+                len = 0;
+            }
+            reFree(re);
+        }
+        if (start != t->start || len != t->len) {
+            printf("FAIL /%s/ on \"%s\" from %d: got %d+%d, want %d+%d\n",
+                t->pattern, t->subject, t->from, start, len, t->start, t->len);
+            failed++;
+        }
+    }
+    printf("%d of %d regex cases passed\n", ncases - failed, ncases);
+    return failed ? 1 : 0;
+}